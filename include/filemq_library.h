@@ -23,6 +23,9 @@
 
 //  External dependencies
 #include <czmq.h>
+#if defined (HAVE_LIBZSTD)
+#include <zstd.h>
+#endif
 
 //  FILEMQ version macros for compile-time API detection
 
@@ -81,6 +81,28 @@ FILEMQ_EXPORT uint8_t
 FILEMQ_EXPORT uint8_t 
     fmq_client_set_inbox (fmq_client_t *self, const char *path);
 
+//  Set the bounds, in bytes, of the credit window the client grants the       
+//  server. The client adapts the window between these to the bandwidth and    
+//  round trip time it measures. Defaults are 4000001 and 256000000.            
+//  Returns >= 0 if successful, -1 if interrupted.
+FILEMQ_EXPORT uint8_t 
+    fmq_client_set_credit_window (fmq_client_t *self, uint64_t minimum, uint64_t maximum);
+
+//  Tell the api whether the server summarizes directories, so subscribing     
+//  asks for just the files that differ from ours. Off by default, as older    
+//  servers drop clients that ask for summaries.                               
+//  Returns >= 0 if successful, -1 if interrupted.
+FILEMQ_EXPORT uint8_t 
+    fmq_client_set_summaries (fmq_client_t *self, uint8_t enabled);
+
+//  Tell the api which directory on this host holds the server's files at      
+//  their virtual paths, so it can copy them itself rather than have the       
+//  server send them. Only for a server on this host that allows it; an        
+//  empty path turns this off, which is the default.                           
+//  Returns >= 0 if successful, -1 if interrupted.
+FILEMQ_EXPORT uint8_t 
+    fmq_client_set_local_root (fmq_client_t *self, const char *path);
+
 //  Return last received status
 FILEMQ_EXPORT uint8_t 
     fmq_client_status (fmq_client_t *self);
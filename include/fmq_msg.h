@@ -37,6 +37,7 @@
         path                longstr     Full path or path prefix
         options             hash        Subscription options
         cache               hash        File SHA-1 signatures
+        digests             msg         Compact file SHA-1 signatures
 
     ICANHAZ_OK - Server confirms the subscription
 
@@ -59,6 +60,21 @@
 
     KTHXBAI - Client closes the peering
 
+    CHEEZBURGERS - The server sends a bundle of whole small files
+        sequence            number 8    Chunk sequence, 0 and up
+        chunk               chunk       Data chunk
+
+    MOAR - Client asks for byte ranges of a file
+        filename            longstr     Relative name of file
+        ranges              chunk       Byte ranges wanted
+
+    ORLY - Client asks what directories hold
+        path                longstr     Full path or path prefix
+        names               chunk       Directories to summarize
+
+    YARLY - Server tells the client what directories hold
+        summary             chunk       Contents of directories
+
     SRSLY - Server refuses client due to access rights
         reason              string      Printable explanation, 255 characters
 
@@ -69,6 +85,7 @@
 #define FMQ_MSG_VERSION                     2
 #define FMQ_MSG_FILE_CREATE                 1
 #define FMQ_MSG_FILE_DELETE                 2
+#define FMQ_MSG_FILE_DELTA                  3
 
 #define FMQ_MSG_OHAI                        1
 #define FMQ_MSG_OHAI_OK                     4
@@ -79,6 +96,10 @@
 #define FMQ_MSG_HUGZ                        9
 #define FMQ_MSG_HUGZ_OK                     10
 #define FMQ_MSG_KTHXBAI                     11
+#define FMQ_MSG_CHEEZBURGERS                12
+#define FMQ_MSG_MOAR                        13
+#define FMQ_MSG_ORLY                        14
+#define FMQ_MSG_YARLY                       15
 #define FMQ_MSG_SRSLY                       128
 #define FMQ_MSG_RTFM                        129
 
@@ -157,6 +178,16 @@ zhash_t *
 void
     fmq_msg_set_cache (fmq_msg_t *self, zhash_t **hash_p);
 
+//  Get a copy of the digests field
+zmsg_t *
+    fmq_msg_digests (fmq_msg_t *self);
+//  Get the digests field and transfer ownership to caller
+zmsg_t *
+    fmq_msg_get_digests (fmq_msg_t *self);
+//  Set the digests field, transferring ownership from caller
+void
+    fmq_msg_set_digests (fmq_msg_t *self, zmsg_t **msg_p);
+
 //  Get/set the credit field
 uint64_t
     fmq_msg_credit (fmq_msg_t *self);
@@ -213,6 +244,36 @@ zchunk_t *
 void
     fmq_msg_set_chunk (fmq_msg_t *self, zchunk_t **chunk_p);
 
+//  Get a copy of the ranges field
+zchunk_t *
+    fmq_msg_ranges (fmq_msg_t *self);
+//  Get the ranges field and transfer ownership to caller
+zchunk_t *
+    fmq_msg_get_ranges (fmq_msg_t *self);
+//  Set the ranges field, transferring ownership from caller
+void
+    fmq_msg_set_ranges (fmq_msg_t *self, zchunk_t **chunk_p);
+
+//  Get a copy of the names field
+zchunk_t *
+    fmq_msg_names (fmq_msg_t *self);
+//  Get the names field and transfer ownership to caller
+zchunk_t *
+    fmq_msg_get_names (fmq_msg_t *self);
+//  Set the names field, transferring ownership from caller
+void
+    fmq_msg_set_names (fmq_msg_t *self, zchunk_t **chunk_p);
+
+//  Get a copy of the summary field
+zchunk_t *
+    fmq_msg_summary (fmq_msg_t *self);
+//  Get the summary field and transfer ownership to caller
+zchunk_t *
+    fmq_msg_get_summary (fmq_msg_t *self);
+//  Set the summary field, transferring ownership from caller
+void
+    fmq_msg_set_summary (fmq_msg_t *self, zchunk_t **chunk_p);
+
 //  Get/set the reason field
 const char *
     fmq_msg_reason (fmq_msg_t *self);
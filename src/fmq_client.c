@@ -22,15 +22,47 @@
 //  TODO: Change these to match your project's needs
 #include "filemq_classes.h"
 
+#if defined (__UTYPE_LINUX)
+#   include <fcntl.h>
+#endif
+
 //  Forward reference to method arguments structure
 typedef struct _client_args_t client_args_t;
 
 //  Additional forward declarations
 typedef struct _sub_t sub_t;
 
-//  There's no point making these configurable
-#define CREDIT_SLICE    1000000
-#define CREDIT_MINIMUM  (CREDIT_SLICE * 4) + 1
+//  The credit window we grant the server adapts to about twice the
+//  bandwidth-delay product we measure, between these default bounds, which
+//  can be changed with the set credit window method.
+#define CREDIT_MINIMUM  4000001
+#define CREDIT_MAXIMUM  256000000
+
+//  We resample the round trip time after this long, in usecs, in case the
+//  route changed; and restart measurement after a pause in data this long
+#define RTT_LIFETIME    10000000
+#define RATE_IDLE       1000000
+
+//  We record how much of a file we have every this many bytes, in a file
+//  in the inbox, so we can resume the file if we're cut off
+#define PROGRESS_INTERVAL   16000000
+#define PROGRESS_FILE       ".fmq-progress"
+
+//  We keep the digests of files in the inbox here, so we only read files
+//  that changed when we tell the server what we have
+#define DIGESTS_FILE        ".fmq-digests"
+
+//  We send those digests to the server in frames of about this size
+#define DIGESTS_FRAME       65536
+
+//  Largest chunk a server sends, as in fmq_server.c; we won't decompress a
+//  chunk to more than this
+#define CHUNK_MAX           16000000
+
+//  Most blocks of rebuilt files we remember, so we can copy them into other
+//  files; past this we forget the files we rebuilt longest ago. At 256 KB a
+//  block, this covers some 25 GB of files.
+#define BLOCKS_MAX          100000
 
 //  This structure defines the context for a client connection
 typedef struct {
@@ -46,7 +78,40 @@ typedef struct {
 
     //  TODO: Add specific properties for your application
     size_t credit;              //  Current credit pending
+    uint64_t window;            //  Credit we aim to have granted
+    uint64_t window_min;        //  Lower bound for window
+    uint64_t window_max;        //  Upper bound for window
+    uint64_t granted;           //  Total credit granted to server
+    uint64_t received;          //  Total chunk data received
+    uint64_t probe_mark;        //  Credit granted before probe was sent
+    int64_t probe_at;           //  When probe credit was sent, or 0
+    int64_t rtt;                //  Minimum round trip time, usecs
+    int64_t rtt_at;             //  When rtt was measured
+    uint64_t bandwidth;         //  Recent maximum delivery rate, bytes/sec
+    uint64_t rate_bytes;        //  Data received since rate_at
+    int64_t rate_at;            //  Start of delivery rate sample
+    int64_t arrived_at;         //  When we last received data
+    bool local;                 //  Server is on this host?
+    char *local_root;           //  Where its files are, if we may copy them
     zfile_t *file;              //  File we're currently writing
+    char *vpath;                //  Virtual path of that file
+    char *digest;               //  Digest of that file, if server told us
+    char *dropped;              //  Virtual path of file we gave up on
+    uint64_t confirmed;         //  Bytes of it we have without gaps
+    uint64_t recorded;          //  Bytes of it we recorded as progress
+    zhash_t *progress;          //  Files we have part of, by virtual path
+    zhash_t *digests;           //  Inode, size, time and digest of files
+    bool digests_dirty;         //  Digests changed since we saved them
+    bool summarized;            //  Server summarizes directories?
+    zhash_t *cache;             //  Digests of inbox files, while subscribing
+    zhash_t *tree;              //  Entries of each directory in the cache
+    zhash_t *summaries;         //  Digests of those directories
+    zlist_t *asked;             //  Directories we asked the server about
+    zlist_t *subtrees;          //  Files and directories that differ
+    zhash_t *blocks;            //  Blocks of files we have, by digest
+    zhash_t *block_lists;       //  Block lists of those files, by name
+    zlist_t *block_files;       //  Those files, oldest first
+    zhash_t *partials;          //  Block lists of files being rebuilt
     char *inbox;                //  Path where files will be stored
     zlist_t *subs;              //  Our subscriptions
     sub_t *sub;                 //  Subscription we're sending
@@ -63,6 +128,28 @@ struct _sub_t {
     char *path;                 //  Path we subscribe to
 };
 
+//  Block of a file in our inbox, that we can copy instead of receiving
+typedef struct {
+    char *filename;             //  File holding block, relative to inbox
+    uint64_t offset;            //  Offset of block in file
+    size_t size;                //  Size of block
+} stored_t;
+
+static void
+s_stored_free (void *argument)
+{
+    stored_t *self = (stored_t *) argument;
+    free (self->filename);
+    free (self);
+}
+
+static void
+s_chunk_free (void *argument)
+{
+    zchunk_t *self = (zchunk_t *) argument;
+    zchunk_destroy (&self);
+}
+
 static sub_t *
 sub_new (client_t *client, char *inbox, char *path)
 {
@@ -86,6 +173,607 @@ sub_destroy (sub_t **self_p)
     }
 }
 
+//  Write size bytes of data to file at offset. Returns 0 if OK, -1 if
+//  the write failed.
+
+static int
+s_write_chunk (zfile_t *file, const byte *data, size_t size, off_t offset)
+{
+    FILE *handle = zfile_handle (file);
+    if (!handle)
+        return -1;
+#if defined (__UNIX__)
+    int fd = fileno (handle);
+    while (size) {
+        ssize_t rc = pwrite (fd, data, size, offset);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        data += rc;
+        size -= rc;
+        offset += rc;
+    }
+    return 0;
+#else
+    if (fseek (handle, (long) offset, SEEK_SET) == -1
+    ||  fwrite (data, 1, size, handle) != size)
+        return -1;
+    return 0;
+#endif
+}
+
+//  Return true if a source file the server told us to copy from is a
+//  virtual path with no ".." in it. We don't want a server to have us
+//  read just any file.
+
+static bool
+s_source_safe (const char *source)
+{
+    if (*source != '/')
+        return false;
+    while (*source) {
+        size_t length = strcspn (source, "/");
+        if (length == 2 && source [0] == '.' && source [1] == '.')
+            return false;
+        source += length + (source [length] == '/');
+    }
+    return true;
+}
+
+//  Return where we find a source file the server told us to copy from,
+//  under the root we were given for its files, or NULL if we may not copy
+//  it. Links must not lead out of the root either. Caller frees the result.
+
+static char *
+s_source_path (client_t *self, const char *source)
+{
+    if (!self->local || !self->local_root || !s_source_safe (source))
+        return NULL;
+    char *path = zsys_sprintf ("%s%s", self->local_root, source);
+#if defined (__UNIX__)
+    char *root = realpath (self->local_root, NULL);
+    char *real = realpath (path, NULL);
+    size_t length = root? strlen (root): 0;
+    bool inside = root && real && strncmp (real, root, length) == 0
+               && (real [length] == '/' || streq (root, "/"));
+    free (root);
+    free (real);
+    if (!inside)
+        zstr_free (&path);
+#endif
+    return path;
+}
+
+//  Copy size bytes at offset of a source file, which the server told us
+//  to read for ourselves, to the same place in file. Returns 0 if OK, -1
+//  if the copy failed.
+
+static int
+s_copy_chunk (zfile_t *file, const char *source, size_t size, off_t offset)
+{
+    FILE *handle = zfile_handle (file);
+    if (!handle)
+        return -1;
+#if defined (__UTYPE_LINUX) && defined (__GLIBC__) \
+ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    //  Have the kernel copy the range, without the data passing through
+    //  us, and sharing blocks where the filesystem can
+    int input = open (source, O_RDONLY | O_CLOEXEC);
+    if (input != -1) {
+        off_t from = offset, to = offset;
+        while (size) {
+            ssize_t rc = copy_file_range (input, &from, fileno (handle), &to,
+                                          size, 0);
+            if (rc == -1 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+                break;
+            size -= rc;
+            offset += rc;
+        }
+        close (input);
+    }
+#endif
+    //  Copy anything the kernel didn't the ordinary way
+    if (size) {
+        zfile_t *input = zfile_new (NULL, source);
+        zchunk_t *chunk = zfile_input (input) == 0?
+            zfile_read (input, size, offset): NULL;
+        int rc = -1;
+        if (chunk && zchunk_size (chunk) == size)
+            rc = s_write_chunk (file, zchunk_data (chunk), size, offset);
+        zchunk_destroy (&chunk);
+        zfile_destroy (&input);
+        return rc;
+    }
+    return 0;
+}
+
+//  Append a range, as an 8-octet offset then an 8-octet size, in network
+//  order, to the ranges we ask for
+
+static void
+s_range_put (zchunk_t *ranges, uint64_t offset, uint64_t size)
+{
+    byte entry [16];
+    int index;
+    for (index = 0; index < 8; index++) {
+        entry [index] = (byte) (offset >> (56 - index * 8));
+        entry [8 + index] = (byte) (size >> (56 - index * 8));
+    }
+    zchunk_extend (ranges, entry, 16);
+}
+
+//  Load the files we have part of, as recorded in our inbox, one per line
+//  as bytes we have, file digest, and virtual path
+
+static void
+s_progress_load (client_t *self)
+{
+    char *filename = zsys_sprintf ("%s/%s", self->inbox, PROGRESS_FILE);
+    FILE *handle = fopen (filename, "r");
+    zstr_free (&filename);
+    if (!handle)
+        return;
+
+    char line [PATH_MAX + 128];
+    while (fgets (line, sizeof (line), handle)) {
+        unsigned long long bytes;
+        char digest [41];
+        int offset = 0;
+        if (sscanf (line, "%llu %40s%n", &bytes, digest, &offset) < 2
+        ||  line [offset] != ' ')
+            continue;           //  Skip anything we don't understand
+        char *vpath = line + offset + 1;
+        vpath [strcspn (vpath, "\n")] = 0;
+        line [offset] = 0;
+        zhash_update (self->progress, vpath, line);
+    }
+    fclose (handle);
+}
+
+//  Save the files we have part of to our inbox
+
+static void
+s_progress_save (client_t *self)
+{
+    char *filename = zsys_sprintf ("%s/%s", self->inbox, PROGRESS_FILE);
+    char *tmpname = zsys_sprintf ("%s.tmp", filename);
+    FILE *handle = fopen (tmpname, "w");
+    if (handle) {
+        char *progress = (char *) zhash_first (self->progress);
+        while (progress) {
+            fprintf (handle, "%s %s\n", progress,
+                zhash_cursor (self->progress));
+            progress = (char *) zhash_next (self->progress);
+        }
+        if (fclose (handle) || rename (tmpname, filename))
+            handle = NULL;
+    }
+    if (!handle)
+        zsys_warning ("unable to save progress to %s", filename);
+    zstr_free (&tmpname);
+    zstr_free (&filename);
+}
+
+//  Record how much of the file we're writing we have. We make sure the
+//  data is on disk first, so what we record is never ahead of it.
+
+static void
+s_progress_record (client_t *self)
+{
+    if (!self->digest || self->confirmed == self->recorded)
+        return;
+#if defined (__UNIX__)
+    fsync (fileno (zfile_handle (self->file)));
+#endif
+    char *progress = zsys_sprintf ("%llu %s",
+        (unsigned long long) self->confirmed, self->digest);
+    zhash_update (self->progress, self->vpath, progress);
+    zstr_free (&progress);
+    self->recorded = self->confirmed;
+    s_progress_save (self);
+}
+
+//  Format the inode, size and time of a file in our inbox, which tell us
+//  whether a digest we stored for it still holds. Returns NULL if there
+//  is no such file.
+
+static char *
+s_digest_stamp (client_t *self, const char *filename)
+{
+    char *fullname = zsys_sprintf ("%s/%s", self->inbox, filename);
+    struct stat stat_buf;
+    char *stamp = NULL;
+    if (stat (fullname, &stat_buf) == 0)
+        stamp = zsys_sprintf ("%lu %ld %ld",
+            (unsigned long) stat_buf.st_ino, (long) stat_buf.st_size,
+            (long) stat_buf.st_mtime);
+    zstr_free (&fullname);
+    return stamp;
+}
+
+//  Load the digests of files in our inbox, one per line as inode, size,
+//  time, digest and filename. A file changed in the same second we saved
+//  its digest might not show it, so we don't trust those.
+
+static void
+s_digests_load (client_t *self)
+{
+    char *filename = zsys_sprintf ("%s/%s", self->inbox, DIGESTS_FILE);
+    time_t saved = zsys_file_modified (filename);
+    FILE *handle = fopen (filename, "r");
+    zstr_free (&filename);
+    if (!handle)
+        return;
+
+    char line [PATH_MAX + 128];
+    while (fgets (line, sizeof (line), handle)) {
+        unsigned long inode;
+        long size, modified;
+        char digest [41];
+        int offset = 0;
+        if (sscanf (line, "%lu %ld %ld %40s%n",
+                    &inode, &size, &modified, digest, &offset) < 4
+        ||  line [offset] != ' '
+        ||  modified >= (long) saved)
+            continue;           //  Skip anything we don't understand or trust
+        char *name = line + offset + 1;
+        name [strcspn (name, "\n")] = 0;
+        line [offset] = 0;
+        zhash_update (self->digests, name, line);
+    }
+    fclose (handle);
+}
+
+//  Save the digests of files in our inbox, if they changed
+
+static void
+s_digests_save (client_t *self)
+{
+    if (!self->digests_dirty)
+        return;
+    char *filename = zsys_sprintf ("%s/%s", self->inbox, DIGESTS_FILE);
+    char *tmpname = zsys_sprintf ("%s.tmp", filename);
+    FILE *handle = fopen (tmpname, "w");
+    if (handle) {
+        char *entry = (char *) zhash_first (self->digests);
+        while (entry) {
+            fprintf (handle, "%s %s\n", entry, zhash_cursor (self->digests));
+            entry = (char *) zhash_next (self->digests);
+        }
+        if (fclose (handle) || rename (tmpname, filename))
+            handle = NULL;
+    }
+    if (handle)
+        self->digests_dirty = false;
+    else
+        zsys_warning ("unable to save digests to %s", filename);
+    zstr_free (&tmpname);
+    zstr_free (&filename);
+}
+
+//  Store the digest of a file we just wrote, so we don't have to read it
+//  to find out. If we don't know the digest, forget what we had.
+
+static void
+s_digests_store (client_t *self, const char *filename, const char *digest)
+{
+    char *stamp = digest? s_digest_stamp (self, filename): NULL;
+    if (stamp && !strchr (filename, '\n')) {
+        char *entry = zsys_sprintf ("%s %s", stamp, digest);
+        zhash_update (self->digests, filename, entry);
+        zstr_free (&entry);
+    }
+    else
+        zhash_delete (self->digests, filename);
+    zstr_free (&stamp);
+    self->digests_dirty = true;
+}
+
+//  Return a hash of the digests of the files in our inbox, by filename
+//  relative to the inbox, to tell the server what we have. We only read
+//  files we have no digest for, or that changed since we stored it.
+
+static zhash_t *
+s_inbox_digests (client_t *self)
+{
+    zhash_t *cache = zhash_new ();
+    zhash_autofree (cache);
+    zhash_t *digests = zhash_new ();
+    zhash_autofree (digests);
+
+    zdir_t *dir = zdir_new (self->inbox, NULL);
+    zfile_t **files = dir? zdir_flatten (dir): NULL;
+    uint index;
+    for (index = 0; files && files [index]; index++) {
+        zfile_t *file = files [index];
+        const char *name = zfile_filename (file, self->inbox);
+        //  Skip our own files, and anything we're not finished with
+        const char *base = strrchr (name, '/');
+        base = base? base + 1: name;
+        if (strncmp (base, ".fmq-", 5) == 0
+        ||  strstr (name, ".fmqpart")
+        ||  strchr (name, '\n'))
+            continue;
+
+        char *stamp = s_digest_stamp (self, name);
+        if (!stamp)
+            continue;
+        size_t stamp_size = strlen (stamp);
+        char *known = (char *) zhash_lookup (self->digests, name);
+        if (known
+        &&  strncmp (known, stamp, stamp_size) == 0
+        &&  known [stamp_size] == ' ') {
+            zhash_update (digests, name, known);
+            zhash_update (cache, name, known + stamp_size + 1);
+        }
+        else {
+            const char *digest = zfile_digest (file);
+            if (digest) {
+                char *entry = zsys_sprintf ("%s %s", stamp, digest);
+                zhash_update (digests, name, entry);
+                zstr_free (&entry);
+                zhash_update (cache, name, (char *) digest);
+            }
+            self->digests_dirty = true;
+        }
+        zstr_free (&stamp);
+    }
+    if (files)
+        zdir_flatten_free (&files);
+    zdir_destroy (&dir);
+
+    //  Keep digests of files we still have
+    if (zhash_size (digests) != zhash_size (self->digests))
+        self->digests_dirty = true;
+    zhash_destroy (&self->digests);
+    self->digests = digests;
+    s_digests_save (self);
+    return cache;
+}
+
+static int
+s_compare_names (const void *item1, const void *item2)
+{
+    return strcmp ((const char *) item1, (const char *) item2);
+}
+
+//  Pack the digests of files we have into frames for the digests field of
+//  ICANHAZ, which is a lot smaller than the cache field. Filenames are
+//  sorted so each can share a prefix with the one before it in its frame.
+
+static zmsg_t *
+s_digests_pack (zhash_t *cache)
+{
+    zmsg_t *digests = zmsg_new ();
+    byte *frame = (byte *) zmalloc (DIGESTS_FRAME + 4 + 0xFFFF + 20);
+    byte *needle = frame;
+    const char *previous = "";
+    zlist_t *filenames = zhash_keys (cache);
+    zlist_sort (filenames, s_compare_names);
+    char *filename = (char *) zlist_first (filenames);
+    while (filename) {
+        const char *digest = (const char *) zhash_lookup (cache, filename);
+        size_t size = strlen (filename);
+        if (size <= 0xFFFF && strlen (digest) == 40) {
+            if (needle - frame >= DIGESTS_FRAME) {
+                zmsg_addmem (digests, frame, needle - frame);
+                needle = frame;
+                previous = "";
+            }
+            size_t shared = 0;
+            while (shared < size && previous [shared] == filename [shared])
+                shared++;
+            needle [0] = (byte) (shared >> 8);
+            needle [1] = (byte)  shared;
+            needle [2] = (byte) ((size - shared) >> 8);
+            needle [3] = (byte)  (size - shared);
+            memcpy (needle + 4, filename + shared, size - shared);
+            needle += 4 + size - shared;
+            int index;
+            for (index = 0; index < 20; index++) {
+                unsigned int octet;
+                sscanf (digest + index * 2, "%2x", &octet);
+                *needle++ = (byte) octet;
+            }
+            previous = filename;
+        }
+        filename = (char *) zlist_next (filenames);
+    }
+    if (needle > frame)
+        zmsg_addmem (digests, frame, needle - frame);
+    zlist_destroy (&filenames);
+    free (frame);
+    return digests;
+}
+
+//  The tree holds the entries of each directory in our inbox, by directory
+//  relative to the inbox, "" being the inbox itself. Entries are "D" for a
+//  directory, or "F" then the digest for a file. We summarize directories
+//  the same way the server does, so we can tell which ones differ.
+
+static void
+s_children_free (void *argument)
+{
+    zhash_t *children = (zhash_t *) argument;
+    zhash_destroy (&children);
+}
+
+//  Join a directory and a name within it; caller frees the result
+
+static char *
+s_tree_join (const char *directory, const char *name)
+{
+    return *directory? zsys_sprintf ("%s/%s", directory, name): strdup (name);
+}
+
+//  Return the entries of a directory, creating it and the directories
+//  above it as needed
+
+static zhash_t *
+s_tree_directory (zhash_t *tree, const char *directory)
+{
+    zhash_t *children = (zhash_t *) zhash_lookup (tree, directory);
+    if (!children) {
+        children = zhash_new ();
+        zhash_autofree (children);
+        zhash_insert (tree, directory, children);
+        zhash_freefn (tree, directory, s_children_free);
+        if (*directory) {
+            char *parent = strdup (directory);
+            char *slash = strrchr (parent, '/');
+            *(slash? slash: parent) = 0;
+            zhash_update (s_tree_directory (tree, parent),
+                          slash? slash + 1: directory, "D");
+            free (parent);
+        }
+    }
+    return children;
+}
+
+//  Return the summary of a directory, working it out if needed: the SHA-1
+//  of a line per entry, sorted by name, of "F" or "D", the entry's digest
+//  or summary, and its name
+
+static const char *
+s_tree_summary (zhash_t *tree, zhash_t *summaries, const char *directory)
+{
+    char *summary = (char *) zhash_lookup (summaries, directory);
+    if (summary)
+        return summary;
+
+    zdigest_t *digest = zdigest_new ();
+    zhash_t *children = (zhash_t *) zhash_lookup (tree, directory);
+    zlist_t *names = children? zhash_keys (children): NULL;
+    if (names)
+        zlist_sort (names, s_compare_names);
+    char *name = names? (char *) zlist_first (names): NULL;
+    while (name) {
+        const char *value = (const char *) zhash_lookup (children, name);
+        char *line;
+        if (*value == 'D') {
+            char *path = s_tree_join (directory, name);
+            line = zsys_sprintf ("D %s %s\n",
+                s_tree_summary (tree, summaries, path), name);
+            free (path);
+        }
+        else
+            line = zsys_sprintf ("F %s %s\n", value + 1, name);
+        zdigest_update (digest, (byte *) line, strlen (line));
+        free (line);
+        name = (char *) zlist_next (names);
+    }
+    zlist_destroy (&names);
+    zhash_update (summaries, directory, (char *) zdigest_string (digest));
+    zdigest_destroy (&digest);
+    return (const char *) zhash_lookup (summaries, directory);
+}
+
+//  Add the digests of all files under a directory in our tree, or of the
+//  one file if it's not a directory, to a cache
+
+static void
+s_tree_cache (client_t *self, const char *path, zhash_t *cache)
+{
+    zhash_t *children = (zhash_t *) zhash_lookup (self->tree, path);
+    if (children) {
+        char *value = (char *) zhash_first (children);
+        while (value) {
+            char *child = s_tree_join (path, zhash_cursor (children));
+            if (*value == 'D')
+                s_tree_cache (self, child, cache);
+            else
+                zhash_update (cache, child, value + 1);
+            free (child);
+            value = (char *) zhash_next (children);
+        }
+    }
+    else {
+        char *digest = (char *) zhash_lookup (self->cache, path);
+        if (digest)
+            zhash_update (cache, path, digest);
+    }
+}
+
+//  Drop what we worked out while reconciling with the server
+
+static void
+s_client_reconciled (client_t *self)
+{
+    zhash_destroy (&self->cache);
+    zhash_destroy (&self->tree);
+    zhash_destroy (&self->summaries);
+    zlist_destroy (&self->asked);
+    zlist_destroy (&self->subtrees);
+}
+
+//  Grant the server more credit if it's using up our window. If no round
+//  trip is being measured, the grant starts one: data beyond what we had
+//  granted before can only arrive after the server gets this grant.
+
+static void
+s_credit_refill (client_t *self)
+{
+    if (self->credit > self->window - self->window / 4)
+        return;
+    size_t credit_to_send = self->window - self->credit;
+    if (!self->probe_at) {
+        self->probe_mark = self->granted;
+        self->probe_at = zclock_usecs ();
+    }
+    self->granted += credit_to_send;
+    self->credit += credit_to_send;
+    fmq_msg_set_credit (self->message, credit_to_send);
+    engine_set_next_event (self, send_credit_event);
+}
+
+//  Account for chunk data received, measuring round trip time and delivery
+//  rate, and adapt the credit window to about twice their product. When we
+//  are limited by the window, the rate we see is about window / rtt, so the
+//  window doubles each round trip until the link is full.
+
+static void
+s_credit_received (client_t *self, size_t size)
+{
+    int64_t now = zclock_usecs ();
+    self->received += size;
+    if (now - self->arrived_at > RATE_IDLE) {
+        //  Data was paused, so restart measurement from here
+        self->arrived_at = now;
+        self->rate_at = now;
+        self->rate_bytes = 0;
+        self->probe_at = 0;
+        return;
+    }
+    self->arrived_at = now;
+    if (self->probe_at && self->received > self->probe_mark) {
+        int64_t rtt = now - self->probe_at;
+        if (!self->rtt || rtt < self->rtt || now - self->rtt_at > RTT_LIFETIME) {
+            self->rtt = rtt;
+            self->rtt_at = now;
+        }
+        self->probe_at = 0;
+    }
+    self->rate_bytes += size;
+    int64_t elapsed = now - self->rate_at;
+    if (self->rtt && elapsed >= self->rtt) {
+        uint64_t rate = self->rate_bytes * 1000000 / elapsed;
+        //  Keep the maximum, but let it decay so we notice a slower link
+        if (rate > self->bandwidth)
+            self->bandwidth = rate;
+        else
+            self->bandwidth -= (self->bandwidth - rate) / 8;
+        self->rate_at = now;
+        self->rate_bytes = 0;
+
+        uint64_t window = 2 * self->bandwidth * self->rtt / 1000000;
+        self->window = window < self->window_min? self->window_min:
+                       window > self->window_max? self->window_max: window;
+    }
+}
+
 //  Allocate properties and structures for a new client instance.
 //  Return 0 if OK, -1 if failed
 
@@ -95,8 +783,21 @@ client_initialize (client_t *self)
     zsys_info ("client is initializing");
     self->subs = zlist_new ();
     self->credit = 0;
+    self->window_min = CREDIT_MINIMUM;
+    self->window_max = CREDIT_MAXIMUM;
+    self->window = CREDIT_MINIMUM;
     self->inbox = NULL;
     self->timeouts = 0;
+    self->blocks = zhash_new ();
+    self->block_lists = zhash_new ();
+    self->block_files = zlist_new ();
+    zlist_autofree (self->block_files);
+    zlist_comparefn (self->block_files, (czmq_comparator *) strcmp);
+    self->partials = zhash_new ();
+    self->progress = zhash_new ();
+    zhash_autofree (self->progress);
+    self->digests = zhash_new ();
+    zhash_autofree (self->digests);
     return 0;
 }
 
@@ -113,6 +814,23 @@ client_terminate (client_t *self)
         sub_destroy (&sub);
     }
     zlist_destroy (&self->subs);
+    s_client_reconciled (self);
+    zhash_destroy (&self->blocks);
+    zhash_destroy (&self->block_lists);
+    zlist_destroy (&self->block_files);
+    zhash_destroy (&self->partials);
+    //  Record how much we have of a file we were cut off in
+    if (self->file)
+        s_progress_record (self);
+    zfile_destroy (&self->file);
+    zhash_destroy (&self->progress);
+    if (self->inbox)
+        s_digests_save (self);
+    zhash_destroy (&self->digests);
+    zstr_free (&self->vpath);
+    zstr_free (&self->digest);
+    zstr_free (&self->dropped);
+    zstr_free (&self->local_root);
     zsys_debug ("client_terminate: subscription list destroyed");
     if (self->inbox) {
         free (self->inbox);
@@ -128,6 +846,9 @@ client_terminate (client_t *self)
 static void
 connect_to_server_endpoint (client_t *self)
 {
+    //  A server on this host can let us copy its files ourselves
+    self->local = strncmp (self->args->endpoint, "ipc://", 6) == 0
+               || strncmp (self->args->endpoint, "inproc://", 9) == 0;
     if (zsock_connect (self->dealer, "%s", self->args->endpoint)) {
         engine_set_exception (self, connect_error_event);
         zsys_warning ("could not connect to %s", self->args->endpoint);
@@ -206,6 +927,8 @@ setup_inbox (client_t *self)
 {
     if (!self->inbox) {
         self->inbox = strdup (self->args->path);
+        s_progress_load (self);
+        s_digests_load (self);
         zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
     }
     else
@@ -214,11 +937,11 @@ setup_inbox (client_t *self)
 
 
 //  ---------------------------------------------------------------------------
-//  format_icanhaz_command
+//  format_orly_command
 //
 
 static void
-format_icanhaz_command (client_t *self)
+format_orly_command (client_t *self)
 {
     if (!self->inbox) {
         engine_set_exception (self, subscribe_error_event);
@@ -237,17 +960,208 @@ format_icanhaz_command (client_t *self)
     while (self->sub) {
         if (streq (path, self->sub->path)) {
             zsys_warning ("already subscribed to %s", path);
-            free (path);
-            return;
+            break;
         }
         self->sub = (sub_t *) zlist_next (self->subs);
     }
-    self->sub = sub_new (self, self->inbox, path);
-    zlist_append (self->subs, self->sub);
-    zsys_debug ("%s added to subscription list", path);
+    if (!self->sub) {
+        self->sub = sub_new (self, self->inbox, path);
+        zlist_append (self->subs, self->sub);
+        zsys_debug ("%s added to subscription list", path);
+    }
     free (path);
 
+    //  Build a tree of what we have, so we can compare it with what the
+    //  server has, a directory at a time from the top. If the server can't
+    //  tell us, we just give it our digests.
+    s_client_reconciled (self);
+    self->cache = s_inbox_digests (self);
+    if (!self->summarized) {
+        engine_set_exception (self, no_summaries_event);
+        return;
+    }
+    self->tree = zhash_new ();
+    self->summaries = zhash_new ();
+    zhash_autofree (self->summaries);
+    s_tree_directory (self->tree, "");
+    char *digest = (char *) zhash_first (self->cache);
+    while (digest) {
+        char *directory = strdup (zhash_cursor (self->cache));
+        char *slash = strrchr (directory, '/');
+        *(slash? slash: directory) = 0;
+        char *value = zsys_sprintf ("F%s", digest);
+        zhash_update (s_tree_directory (self->tree, directory),
+            slash? slash + 1: zhash_cursor (self->cache), value);
+        free (value);
+        free (directory);
+        digest = (char *) zhash_next (self->cache);
+    }
+    self->asked = zlist_new ();
+    zlist_autofree (self->asked);
+    zlist_append (self->asked, "");
+    self->subtrees = zlist_new ();
+    zlist_autofree (self->subtrees);
+
+    fmq_msg_set_path (self->message, self->sub->path);
+    zchunk_t *names = zchunk_new ("\n", 1);
+    fmq_msg_set_names (self->message, &names);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  compare_summaries
+//
+
+static void
+compare_summaries (client_t *self)
+{
+    //  For each directory we asked about, the server sends a 4-octet count
+    //  of entries, all ones if it has no such directory, then for each a
+    //  1-octet type, a 2-octet size and name, and a 20-octet SHA-1. Files
+    //  that differ, and directories we don't have, go on our list to ask
+    //  for; directories we both have but that differ, we ask about next.
+    zchunk_t *summary = fmq_msg_summary (self->message);
+    const byte *needle = summary? zchunk_data (summary): NULL;
+    const byte *ceiling = summary? needle + zchunk_size (summary): NULL;
+    zlist_t *next = zlist_new ();
+    zlist_autofree (next);
+
+    char *directory = self->asked? (char *) zlist_first (self->asked): NULL;
+    while (directory) {
+        uint32_t count = 0xFFFFFFFF;
+        if (needle && needle + 4 <= ceiling) {
+            count = ((uint32_t) needle [0] << 24) + ((uint32_t) needle [1] << 16)
+                  + ((uint32_t) needle [2] << 8) + (uint32_t) needle [3];
+            needle += 4;
+        }
+        else
+            needle = NULL;      //  Short summary, don't trust the rest
+        if (count == 0xFFFFFFFF)
+            zlist_append (self->subtrees, directory);
+
+        zhash_t *children = (zhash_t *) zhash_lookup (self->tree, directory);
+        while (count != 0xFFFFFFFF && count--) {
+            size_t size = needle && needle + 3 <= ceiling?
+                ((size_t) needle [1] << 8) + needle [2]: 0;
+            if (!needle || needle + 3 + size + 20 > ceiling) {
+                zsys_warning ("malformed summary, asking for %s", directory);
+                zlist_append (self->subtrees, directory);
+                needle = NULL;
+                break;
+            }
+            byte type = needle [0];
+            char *name = (char *) zmalloc (size + 1);
+            memcpy (name, needle + 3, size);
+            char hex [41];
+            int index;
+            for (index = 0; index < 20; index++)
+                sprintf (hex + index * 2, "%02X", needle [3 + size + index]);
+            needle += 3 + size + 20;
+
+            char *path = s_tree_join (directory, name);
+            const char *mine = children?
+                (const char *) zhash_lookup (children, name): NULL;
+            if (type == 2 && mine && *mine == 'D') {
+                if (!streq (s_tree_summary (self->tree, self->summaries, path),
+                            hex))
+                    zlist_append (next, path);
+            }
+            else
+            if (!(type == 1 && mine && *mine == 'F' && streq (mine + 1, hex)))
+                zlist_append (self->subtrees, path);
+            free (path);
+            free (name);
+        }
+        directory = (char *) zlist_next (self->asked);
+    }
+    zlist_destroy (&self->asked);
+    self->asked = next;
+
+    if (zlist_size (self->asked)) {
+        zchunk_t *names = zchunk_new (NULL, 0);
+        directory = (char *) zlist_first (self->asked);
+        while (directory) {
+            zchunk_extend (names, directory, strlen (directory));
+            zchunk_extend (names, "\n", 1);
+            directory = (char *) zlist_next (self->asked);
+        }
+        fmq_msg_set_path (self->message, self->sub->path);
+        fmq_msg_set_names (self->message, &names);
+        engine_set_next_event (self, descend_event);
+    }
+    else
+        engine_set_next_event (self, reconciled_event);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  format_icanhaz_command
+//
+
+static void
+format_icanhaz_command (client_t *self)
+{
     fmq_msg_set_path (self->message, self->sub->path);
+
+    //  Ask for just the files and directories that differ, telling the
+    //  server the digests of any of those files we have, in case it hadn't
+    //  read them yet. If the server couldn't tell us what our path holds,
+    //  or we didn't ask, ask for all files we don't already have.
+    bool everything = !self->subtrees;
+    zhash_t *cache = zhash_new ();
+    zhash_autofree (cache);
+    zchunk_t *subtrees = zchunk_new (NULL, 0);
+    char *path = self->subtrees? (char *) zlist_first (self->subtrees): NULL;
+    while (path) {
+        if (!*path)
+            everything = true;
+        s_tree_cache (self, path, cache);
+        zchunk_extend (subtrees, path, strlen (path));
+        zchunk_extend (subtrees, "\n", 1);
+        path = (char *) zlist_next (self->subtrees);
+    }
+    zchunk_extend (subtrees, "", 1);
+    if (everything) {
+        zhash_destroy (&cache);
+        cache = self->cache;
+        self->cache = NULL;
+    }
+    zmsg_t *digests = s_digests_pack (cache);
+    zhash_destroy (&cache);
+    fmq_msg_set_digests (self->message, &digests);
+
+    //  We can take small files in bundles, and deltas of big files
+    zhash_t *options = zhash_new ();
+    zhash_autofree (options);
+    zhash_insert (options, "resync", "1");
+    if (!everything)
+        zhash_insert (options, "subtrees", zchunk_data (subtrees));
+    zchunk_destroy (&subtrees);
+    zhash_insert (options, "bundle", "1");
+    zhash_insert (options, "delta", "1");
+#if defined (HAVE_LIBZSTD)
+    zhash_insert (options, "compress", "zstd");
+#endif
+    if (self->local && self->local_root)
+        zhash_insert (options, "local", "1");
+    //  Ask to resume any files we have part of
+    char *resume = NULL;
+    char *progress = (char *) zhash_first (self->progress);
+    while (progress) {
+        const char *vpath = zhash_cursor (self->progress);
+        if (strncmp (vpath, self->sub->path, strlen (self->sub->path)) == 0) {
+            char *lines = zsys_sprintf ("%s%s %s\n",
+                resume? resume: "", progress, vpath);
+            zstr_free (&resume);
+            resume = lines;
+        }
+        progress = (char *) zhash_next (self->progress);
+    }
+    if (resume)
+        zhash_insert (options, "resume", resume);
+    zstr_free (&resume);
+    fmq_msg_set_options (self->message, &options);
+    s_client_reconciled (self);
 }
 
 
@@ -295,15 +1209,7 @@ static void
 signal_subscribe_success (client_t *self)
 {
     zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
-    size_t credit_to_send = 0;
-    while (self->credit < CREDIT_MINIMUM) {
-        credit_to_send += CREDIT_SLICE;
-        self->credit += CREDIT_SLICE;
-    }
-    if (credit_to_send) {
-        fmq_msg_set_credit (self->message, credit_to_send);
-        engine_set_next_event (self, send_credit_event);
-    }
+    s_credit_refill (self);
 }
 
 
@@ -324,17 +1230,15 @@ handle_subscribe_timeout (client_t *self)
 
 
 //  ---------------------------------------------------------------------------
-//  process_the_patch
-//
+//  Return the name of a file, relative to our inbox, from its virtual path
+//  on the server, or NULL if we didn't subscribe to that
 
-static void
-process_the_patch (client_t *self)
+static const char *
+s_client_resolve (client_t *self, const char *filename)
 {
-    const char *filename = fmq_msg_filename (self->message);
-
     if (*filename != '/') {
         zsys_error ("filename did not start with a \'/\'");
-        return;
+        return NULL;
     }
 
     sub_t *subscr = (sub_t *) zlist_first (self->subs);
@@ -350,16 +1254,367 @@ process_the_patch (client_t *self)
     }
     if (!found) {
         zsys_debug ("subscription not found for %s", filename);
-        return;
+        return NULL;
     }
 
     if ('/' == *filename) filename++;
+    return filename;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Block lists, as sent with FILE DELTA, hold a 4-octet size in network
+//  order then a 20-octet SHA-1 digest for each block of a file
+
+#define BLOCK_ENTRY     24
+
+static size_t
+s_block_size (const byte *entry)
+{
+    return ((size_t) entry [0] << 24) + ((size_t) entry [1] << 16)
+         + ((size_t) entry [2] << 8) + (size_t) entry [3];
+}
+
+//  Format the digest of a block as a printable key
+
+static void
+s_block_key (const byte *entry, char *key)
+{
+    int index;
+    for (index = 0; index < 20; index++)
+        sprintf (key + index * 2, "%02X", entry [4 + index]);
+}
+
+//  Read a block from file, and return it if it has the digest we want, or
+//  NULL if not
+
+static zchunk_t *
+s_block_read (zfile_t *file, uint64_t offset, const byte *entry)
+{
+    size_t size = s_block_size (entry);
+    zchunk_t *data = zfile_read (file, size, (off_t) offset);
+    if (data && zchunk_size (data) == size) {
+        zdigest_t *digest = zdigest_new ();
+        zdigest_update (digest, zchunk_data (data), size);
+        bool same = memcmp (zdigest_data (digest), entry + 4, 20) == 0;
+        zdigest_destroy (&digest);
+        if (same)
+            return data;
+    }
+    zchunk_destroy (&data);
+    return NULL;
+}
+
+//  ---------------------------------------------------------------------------
+//  Start rebuilding a file from the block list the server sent for it. We
+//  copy the blocks we have, from our old copy of the file or from any file
+//  we have the block in, into a new copy beside it, and ask with MOAR for
+//  the ranges we don't have.
+
+static void
+s_client_ask_ranges (client_t *self, const char *filename)
+{
+    zchunk_t *chunk = fmq_msg_chunk (self->message);
+    const byte *entries = zchunk_data (chunk);
+    size_t count = zchunk_size (chunk) / BLOCK_ENTRY;
+
+    char *partname = zsys_sprintf ("%s.fmqpart", filename);
+    zfile_t *part = zfile_new (self->inbox, partname);
+    zfile_remove (part);
+    bool rebuild = count > 0 && zfile_output (part) == 0;
+    zfile_t *local = zfile_new (self->inbox, filename);
+    bool have_local = rebuild && zfile_input (local) == 0;
+
+    zchunk_t *ranges = zchunk_new (NULL, 0);
+    uint64_t offset = 0;
+    uint64_t start = 0;
+    uint64_t length = 0;
+    size_t index;
+    for (index = 0; rebuild && index < count; index++) {
+        const byte *entry = entries + index * BLOCK_ENTRY;
+        size_t size = s_block_size (entry);
+        zchunk_t *data = NULL;
+        if (have_local)
+            data = s_block_read (local, offset, entry);
+        if (!data) {
+            char key [41];
+            s_block_key (entry, key);
+            stored_t *stored = (stored_t *) zhash_lookup (self->blocks, key);
+            if (stored && stored->size == size) {
+                zfile_t *file = zfile_new (self->inbox, stored->filename);
+                if (zfile_input (file) == 0)
+                    data = s_block_read (file, stored->offset, entry);
+                zfile_destroy (&file);
+            }
+        }
+        bool copied = data
+            && s_write_chunk (part, zchunk_data (data), size, offset) == 0;
+        zchunk_destroy (&data);
+        if (!copied) {
+            //  Merge adjacent blocks into one range
+            if (length && start + length == offset)
+                length += size;
+            else {
+                if (length)
+                    s_range_put (ranges, start, length);
+                start = offset;
+                length = size;
+            }
+        }
+        offset += size;
+    }
+    //  A range of size zero runs to the end of the file
+    if (!rebuild)
+        s_range_put (ranges, 0, 0);
+    else
+    if (length)
+        s_range_put (ranges, start, start + length == offset? 0: length);
+    zfile_destroy (&local);
+    zfile_destroy (&part);
+    zstr_free (&partname);
+
+    if (rebuild) {
+        zhash_update (self->partials, filename,
+            zchunk_new (entries, count * BLOCK_ENTRY));
+        zhash_freefn (self->partials, filename, s_chunk_free);
+    }
+    zsys_debug ("asking for %zu ranges of %s/%s",
+        zchunk_size (ranges) / 16, self->inbox, filename);
+    fmq_msg_t *moar = fmq_msg_new ();
+    fmq_msg_set_id (moar, FMQ_MSG_MOAR);
+    fmq_msg_set_filename (moar, fmq_msg_filename (self->message));
+    fmq_msg_set_ranges (moar, &ranges);
+    fmq_msg_send (moar, self->dealer);
+    fmq_msg_destroy (&moar);
+}
+
+//  ---------------------------------------------------------------------------
+//  Forget where the blocks of a file are, as it changed or went away. Blocks
+//  we last saw in other files stay.
+
+static void
+s_client_forget_blocks (client_t *self, const char *filename)
+{
+    zchunk_t *entries = (zchunk_t *) zhash_lookup (self->block_lists,
+                                                   filename);
+    if (!entries)
+        return;
+    size_t index;
+    for (index = 0; index < zchunk_size (entries) / BLOCK_ENTRY; index++) {
+        char key [41];
+        s_block_key (zchunk_data (entries) + index * BLOCK_ENTRY, key);
+        stored_t *stored = (stored_t *) zhash_lookup (self->blocks, key);
+        if (stored && streq (stored->filename, filename))
+            zhash_delete (self->blocks, key);
+    }
+    zhash_delete (self->block_lists, filename);
+    zlist_remove (self->block_files, (void *) filename);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Replace a file with the copy we rebuilt, if any, and remember where its
+//  blocks are so we can copy them into other files
+
+static void
+s_client_finish_rebuild (client_t *self, const char *filename)
+{
+    zchunk_t *entries = (zchunk_t *) zhash_lookup (self->partials, filename);
+    if (!entries)
+        return;
+    char *partname = zsys_sprintf ("%s/%s.fmqpart", self->inbox, filename);
+    char *fullname = zsys_sprintf ("%s/%s", self->inbox, filename);
+#if defined (__WINDOWS__)
+    remove (fullname);
+#endif
+    s_client_forget_blocks (self, filename);
+    if (rename (partname, fullname))
+        zsys_warning ("unable to replace file %s", fullname);
+    else {
+        uint64_t offset = 0;
+        size_t index;
+        for (index = 0; index < zchunk_size (entries) / BLOCK_ENTRY; index++) {
+            const byte *entry = zchunk_data (entries) + index * BLOCK_ENTRY;
+            stored_t *stored = (stored_t *) zmalloc (sizeof (stored_t));
+            stored->filename = strdup (filename);
+            stored->offset = offset;
+            stored->size = s_block_size (entry);
+            char key [41];
+            s_block_key (entry, key);
+            zhash_update (self->blocks, key, stored);
+            zhash_freefn (self->blocks, key, s_stored_free);
+            offset += stored->size;
+        }
+        //  Keep the block list, so we know what to forget, and the table
+        //  to its bound
+        zhash_insert (self->block_lists, filename, entries);
+        zhash_freefn (self->block_lists, filename, s_chunk_free);
+        zhash_freefn (self->partials, filename, NULL);
+        zlist_append (self->block_files, strdup (filename));
+        while (zhash_size (self->blocks) > BLOCKS_MAX
+        &&     zlist_size (self->block_files) > 1) {
+            char *oldest = strdup ((char *) zlist_first (self->block_files));
+            s_client_forget_blocks (self, oldest);
+            free (oldest);
+        }
+    }
+    zstr_free (&partname);
+    zstr_free (&fullname);
+    zhash_delete (self->partials, filename);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Decompress the chunk of a CHEEZBURGER if the server compressed it.
+//  Returns 0 if OK, or -1 if we can't.
+
+static int
+s_client_decompress (client_t *self)
+{
+    zhash_t *headers = fmq_msg_headers (self->message);
+    char *codec = headers? (char *) zhash_lookup (headers, "codec"): NULL;
+    if (!codec)
+        return 0;
+#if defined (HAVE_LIBZSTD)
+    char *value = (char *) zhash_lookup (headers, "size");
+    size_t size = value? (size_t) strtoull (value, NULL, 10): 0;
+    if (streq (codec, "zstd") && value && size <= CHUNK_MAX) {
+        zchunk_t *plain = zchunk_new (NULL, size);
+        zchunk_t *chunk = fmq_msg_chunk (self->message);
+        size_t rc = ZSTD_decompress (zchunk_data (plain), size,
+            zchunk_data (chunk), zchunk_size (chunk));
+        if (!ZSTD_isError (rc) && rc == size) {
+            zchunk_set (plain, NULL, size);
+            fmq_msg_set_chunk (self->message, &plain);
+            return 0;
+        }
+        zchunk_destroy (&plain);
+    }
+#endif
+    zsys_error ("unable to decompress %s chunk of %s", codec,
+        fmq_msg_filename (self->message));
+    return -1;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return the credit the server counted for the chunk of a CHEEZBURGER:
+//  its size before compression, or the length of a chunk it didn't send,
+//  or else its size.
+
+static size_t
+s_client_chunk_credit (client_t *self)
+{
+    zhash_t *headers = fmq_msg_headers (self->message);
+    char *value = NULL;
+    if (headers)
+        value = (char *) zhash_lookup (headers,
+            zhash_lookup (headers, "codec")? "size": "length");
+    return value? (size_t) strtoull (value, NULL, 10)
+                : zchunk_size (fmq_msg_chunk (self->message));
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Ask the server with MOAR for all of the file we gave up on, now that it
+//  has finished sending it
+
+static void
+s_client_ask_again (client_t *self)
+{
+    zsys_debug ("asking again for %s", self->dropped);
+    zchunk_t *ranges = zchunk_new (NULL, 16);
+    s_range_put (ranges, 0, 0);
+    fmq_msg_t *moar = fmq_msg_new ();
+    fmq_msg_set_id (moar, FMQ_MSG_MOAR);
+    fmq_msg_set_filename (moar, self->dropped);
+    fmq_msg_set_ranges (moar, &ranges);
+    fmq_msg_send (moar, self->dealer);
+    fmq_msg_destroy (&moar);
+    zstr_free (&self->dropped);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Give up on the file we're receiving. We remove what we have of it and
+//  forget our progress, so we don't vouch for it or resume it; the server
+//  sends it again.
+
+static void
+s_client_drop_file (client_t *self, const char *filename)
+{
+    if (self->file) {
+        zfile_remove (self->file);
+        zfile_destroy (&self->file);
+    }
+    zhash_delete (self->partials, filename);
+    if (self->vpath && zhash_lookup (self->progress, self->vpath)) {
+        zhash_delete (self->progress, self->vpath);
+        s_progress_save (self);
+    }
+    zstr_free (&self->vpath);
+    zstr_free (&self->digest);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  process_the_patch
+//
+
+static void
+process_the_patch (client_t *self)
+{
+    const char *vpath = fmq_msg_filename (self->message);
+    const char *filename = s_client_resolve (self, vpath);
+    if (!filename)
+        return;
+
+    //  If we can't decompress a chunk, we give up on the file and skip the
+    //  rest of it, then ask the server for all of it again
+    if (self->dropped && !streq (self->dropped, vpath))
+        s_client_ask_again (self);      //  Server moved on without an end
+    if (!self->dropped && s_client_decompress (self)) {
+        s_client_drop_file (self, filename);
+        self->dropped = strdup (vpath);
+    }
+    if (self->dropped) {
+        size_t size = s_client_chunk_credit (self);
+        if (size) {
+            self->credit -= size;
+            s_credit_received (self, size);
+        }
+        else
+            s_client_ask_again (self);  //  End of file
+        return;
+    }
 
     if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_CREATE) {
+        //  The server couldn't read this chunk, as the file changed under
+        //  it, so drop what we have; it sends the new file after
+        zhash_t *headers = fmq_msg_headers (self->message);
+        if (headers && zhash_lookup (headers, "failed")) {
+            char *length = (char *) zhash_lookup (headers, "length");
+            size_t size = length? (size_t) strtoull (length, NULL, 10): 0;
+            zsys_warning ("server could not send %s/%s", self->inbox,
+                filename);
+            s_client_drop_file (self, filename);
+            self->credit -= size;
+            s_credit_received (self, size);
+            return;
+        }
         if (self->file == NULL) {
             zsys_debug ("creating file object for %s/%s", self->inbox,
                 filename);
-            self->file = zfile_new (self->inbox, filename);
+            //  Write into the copy we're rebuilding, if any
+            if (zhash_lookup (self->partials, filename)) {
+                char *partname = zsys_sprintf ("%s.fmqpart", filename);
+                self->file = zfile_new (self->inbox, partname);
+                zstr_free (&partname);
+            }
+            else {
+                s_client_forget_blocks (self, filename);
+                self->file = zfile_new (self->inbox, filename);
+            }
             if (zfile_output (self->file)) {
                 zsys_warning ("unable to write to file %s/%s", self->inbox,
                     filename);
@@ -367,30 +1622,104 @@ process_the_patch (client_t *self)
                 zfile_destroy (&self->file);
                 return;
             }
+            //  Keep track of how much we have, if we can resume the file;
+            //  the server only starts past zero when we asked it to
+            zstr_free (&self->vpath);
+            zstr_free (&self->digest);
+            self->vpath = strdup (fmq_msg_filename (self->message));
+            char *digest = headers?
+                (char *) zhash_lookup (headers, "digest"): NULL;
+            if (digest && !zhash_lookup (self->partials, filename))
+                self->digest = strdup (digest);
+            self->confirmed = fmq_msg_offset (self->message);
+            self->recorded = 0;
         }
-        //  Try to write, ignore errors in this version
+        //  A server on this host may tell us to copy the chunk from the
+        //  source file ourselves, rather than send it. We only do that for
+        //  a server we reached over ipc:// or inproc://, from under the
+        //  root we were given for its files, and treat anything else as a
+        //  chunk we failed to write.
+        char *source = headers?
+            (char *) zhash_lookup (headers, "source"): NULL;
+        char *length = source?
+            (char *) zhash_lookup (headers, "length"): NULL;
+        char *copy = length? s_source_path (self, source): NULL;
+        if (length && !copy)
+            zsys_warning ("refusing to copy chunk of %s/%s from %s",
+                self->inbox, filename, source);
         zchunk_t *chunk = fmq_msg_chunk (self->message);
-        if (zchunk_size (chunk) > 0) {
+        size_t chunk_size = length? (size_t) strtoull (length, NULL, 10)
+                                  : zchunk_size (chunk);
+
+        //  Try to write, ignore errors in this version
+        if (chunk_size > 0) {
             zsys_debug ("writing chunk at offset %u of %s/%s",
                 fmq_msg_offset (self->message), self->inbox, filename);
-            zfile_write (self->file, chunk, fmq_msg_offset (self->message));
-            self->credit -= zchunk_size (chunk);
+            int rc = copy?
+                s_copy_chunk (self->file, copy, chunk_size,
+                              fmq_msg_offset (self->message)):
+                length? -1:
+                s_write_chunk (self->file, zchunk_data (chunk),
+                               chunk_size, fmq_msg_offset (self->message));
+            if (rc) {
+                zsys_warning ("unable to write to file %s/%s", self->inbox,
+                    filename);
+                //  We can't vouch for the file any more
+                zstr_free (&self->digest);
+            }
+            else
+            if (fmq_msg_offset (self->message) == self->confirmed) {
+                self->confirmed += chunk_size;
+                if (self->confirmed - self->recorded >= PROGRESS_INTERVAL)
+                    s_progress_record (self);
+            }
+            self->credit -= chunk_size;
+            s_credit_received (self, chunk_size);
         }
         else {
             //  Zero-sized chunk means end of file, so report back to caller
             //  Communicate back to caller via the msgpipe
             zsys_debug ("file complete %s/%s", self->inbox, filename);
+#if defined (__UNIX__)
+            //  End of file is at the file size, which may be less than
+            //  the copy we had before
+            if (ftruncate (fileno (zfile_handle (self->file)),
+                           fmq_msg_offset (self->message)))
+                zsys_warning ("unable to truncate file %s/%s", self->inbox,
+                    filename);
+#endif
+            zfile_destroy (&self->file);
+            zstr_free (&self->vpath);
+            if (zhash_lookup (self->progress, fmq_msg_filename (self->message))) {
+                zhash_delete (self->progress, fmq_msg_filename (self->message));
+                s_progress_save (self);
+            }
+            s_client_finish_rebuild (self, filename);
+            //  The server told us the digest of the file, unless we rebuilt
+            //  it, so we won't have to read it to tell the server we have it
+            s_digests_store (self, filename, self->digest);
+            zstr_free (&self->digest);
             zsock_send (self->msgpipe, "sss", "FILE UPDATED", self->inbox,
                 filename);
-            zfile_destroy (&self->file);
         }
+        zstr_free (&copy);
+    }
+    else
+    if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_DELTA) {
+        size_t chunk_size = zchunk_size (fmq_msg_chunk (self->message));
+        self->credit -= chunk_size;
+        s_credit_received (self, chunk_size);
+        s_client_ask_ranges (self, filename);
     }
     else
     if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_DELETE) {
         zsys_debug ("delete %s/%s", self->inbox, filename);
+        zhash_delete (self->partials, filename);
+        s_client_forget_blocks (self, filename);
         zfile_t *file = zfile_new (self->inbox, filename);
         zfile_remove (file);
         zfile_destroy (&file);
+        s_digests_store (self, filename, NULL);
 
         //  Report file deletion back to caller
         //  Notify the caller of deletion
@@ -400,6 +1729,72 @@ process_the_patch (client_t *self)
 }
 
 
+//  ---------------------------------------------------------------------------
+//  process_the_bundle
+//
+
+static void
+process_the_bundle (client_t *self)
+{
+    //  The bundle holds whole files, each a name then contents, each of
+    //  those a 4-octet size in network order then data
+    zchunk_t *chunk = fmq_msg_chunk (self->message);
+    const byte *needle = zchunk_data (chunk);
+    const byte *ceiling = needle + zchunk_size (chunk);
+    size_t received = 0;
+    while (needle < ceiling) {
+        const byte *field [2];
+        size_t field_size [2];
+        int index;
+        for (index = 0; index < 2; index++) {
+            if (needle + 4 > ceiling) {
+                zsys_error ("malformed bundle, ignored");
+                return;
+            }
+            field_size [index] = ((size_t) needle [0] << 24)
+                               + ((size_t) needle [1] << 16)
+                               + ((size_t) needle [2] << 8)
+                               +  (size_t) needle [3];
+            field [index] = needle + 4;
+            needle += 4 + field_size [index];
+            if (needle > ceiling) {
+                zsys_error ("malformed bundle, ignored");
+                return;
+            }
+        }
+        received += field_size [1];
+        char *vpath = (char *) zmalloc (field_size [0] + 1);
+        memcpy (vpath, field [0], field_size [0]);
+        const char *filename = s_client_resolve (self, vpath);
+        if (filename) {
+            zsys_debug ("writing %s/%s", self->inbox, filename);
+            s_client_forget_blocks (self, filename);
+            zfile_t *file = zfile_new (self->inbox, filename);
+            if (zfile_output (file)
+            ||  s_write_chunk (file, field [1], field_size [1], 0)) {
+                zsys_warning ("unable to write to file %s/%s", self->inbox,
+                    filename);
+                zfile_destroy (&file);
+                s_digests_store (self, filename, NULL);
+            }
+            else {
+                //  We have the data in hand, so digest it as we write it
+                zfile_destroy (&file);
+                zdigest_t *digest = zdigest_new ();
+                zdigest_update (digest, field [1], field_size [1]);
+                s_digests_store (self, filename, zdigest_string (digest));
+                zdigest_destroy (&digest);
+                zsock_send (self->msgpipe, "sss", "FILE UPDATED", self->inbox,
+                    filename);
+            }
+        }
+        free (vpath);
+    }
+    self->credit -= received;
+    s_credit_received (self, received);
+}
+
+
 //  ---------------------------------------------------------------------------
 //  refill_credit_as_needed
 //
@@ -408,15 +1803,56 @@ static void
 refill_credit_as_needed (client_t *self)
 {
     zsys_debug ("refill credit as needed");
-    size_t credit_to_send = 0;
-    while (self->credit < CREDIT_MINIMUM) {
-        credit_to_send += CREDIT_SLICE;
-        self->credit += CREDIT_SLICE;
-    }
-    if (credit_to_send) {
-        fmq_msg_set_credit (self->message, credit_to_send);
-        engine_set_next_event (self, send_credit_event);
+    s_credit_refill (self);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  setup_credit_window
+//
+
+static void
+setup_credit_window (client_t *self)
+{
+    if (self->args->minimum == 0
+    ||  self->args->minimum > self->args->maximum) {
+        zsock_send (self->cmdpipe, "sis", "FAILURE", -1,
+            "credit window minimum must be > 0 and <= maximum");
+        return;
     }
+    self->window_min = self->args->minimum;
+    self->window_max = self->args->maximum;
+    if (self->window < self->window_min)
+        self->window = self->window_min;
+    if (self->window > self->window_max)
+        self->window = self->window_max;
+    zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  setup_summaries
+//
+
+static void
+setup_summaries (client_t *self)
+{
+    self->summarized = self->args->enabled != 0;
+    zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  setup_local_root
+//
+
+static void
+setup_local_root (client_t *self)
+{
+    zstr_free (&self->local_root);
+    if (*self->args->path)
+        self->local_root = strdup (self->args->path);
+    zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
 }
 
 
@@ -488,6 +1924,60 @@ fmq_client_test (bool verbose)
         printf ("\n");
 
     //  @selftest
+    //  We only copy from files a local server names by virtual path, and
+    //  find them under the root we were given for its files
+    assert (s_source_safe ("/photos/june.jpg"));
+    assert (!s_source_safe ("photos/june.jpg"));
+    assert (!s_source_safe ("/photos/../../etc/passwd"));
+    zfile_t *source = zfile_new (".", ".fmq_client_source");
+    int rc = zfile_output (source);
+    assert (rc == 0);
+    zfile_close (source);
+    client_t probe;
+    memset (&probe, 0, sizeof (probe));
+    char *path = s_source_path (&probe, "/.fmq_client_source");
+    assert (!path);
+    probe.local = true;
+    probe.local_root = ".";
+    path = s_source_path (&probe, "/.fmq_client_source");
+    assert (path && streq (path, "./.fmq_client_source"));
+    zstr_free (&path);
+    assert (!s_source_path (&probe, "/../.fmq_client_source"));
+    probe.local_root = NULL;
+    zfile_remove (source);
+    zfile_destroy (&source);
+
+    //  We forget the blocks of a rebuilt file when it changes
+    probe.inbox = ".";
+    probe.blocks = zhash_new ();
+    probe.block_lists = zhash_new ();
+    probe.block_files = zlist_new ();
+    zlist_autofree (probe.block_files);
+    zlist_comparefn (probe.block_files, (czmq_comparator *) strcmp);
+    probe.partials = zhash_new ();
+    byte entries [2 * BLOCK_ENTRY] = { 0 };
+    entries [3] = entries [BLOCK_ENTRY + 3] = 1;
+    entries [BLOCK_ENTRY + 4] = 1;
+    zhash_insert (probe.partials, ".fmq_client_selftest",
+        zchunk_new (entries, sizeof (entries)));
+    zhash_freefn (probe.partials, ".fmq_client_selftest", s_chunk_free);
+    zfile_t *part = zfile_new (NULL, ".fmq_client_selftest.fmqpart");
+    rc = zfile_output (part);
+    assert (rc == 0);
+    zfile_destroy (&part);
+    s_client_finish_rebuild (&probe, ".fmq_client_selftest");
+    assert (zhash_size (probe.blocks) == 2);
+    assert (zlist_size (probe.block_files) == 1);
+    s_client_forget_blocks (&probe, ".fmq_client_selftest");
+    assert (zhash_size (probe.blocks) == 0);
+    assert (zhash_size (probe.block_lists) == 0);
+    assert (zlist_size (probe.block_files) == 0);
+    zhash_destroy (&probe.blocks);
+    zhash_destroy (&probe.block_lists);
+    zlist_destroy (&probe.block_files);
+    zhash_destroy (&probe.partials);
+    zsys_file_delete (".fmq_client_selftest");
+
     //  Start a server to test against, and bind to endpoint
     zactor_t *server = zactor_new (fmq_server, "fmq_server");
     if (verbose)
@@ -496,7 +1986,7 @@ fmq_client_test (bool verbose)
 
     //  Create directories used for the test.
     zsys_debug ("attempting to create directory");
-    int rc = zsys_dir_create ("./fmqserver");
+    rc = zsys_dir_create ("./fmqserver");
     if (rc == 0)
         zsys_debug ("./fmqserver created");
     else
@@ -509,6 +1999,26 @@ fmq_client_test (bool verbose)
         zsys_error ("./fmqclient NOT created");
     assert (rc == 0);
 
+    //  The client has one of the files the server has already, so only
+    //  the other is sent when it subscribes
+    const char *paths [] = {
+        "./fmqserver", "existing.txt",
+        "./fmqserver", "missing.txt",
+        "./fmqclient", "existing.txt"
+    };
+    int index;
+    for (index = 0; index < 6; index += 2) {
+        zfile_t *file = zfile_new (paths [index], paths [index + 1]);
+        rc = zfile_output (file);
+        assert (rc == 0);
+        zchunk_t *content = zchunk_new (paths [index + 1],
+                                        strlen (paths [index + 1]));
+        rc = zfile_write (file, content, 0);
+        assert (rc == 0);
+        zchunk_destroy (&content);
+        zfile_destroy (&file);
+    }
+
     //  Tell the server to publish from directory just created
     zsys_debug ("attempting to publish");
     zstr_sendx (server, "PUBLISH", "./fmqserver", "/", NULL);
@@ -530,6 +2040,16 @@ fmq_client_test (bool verbose)
     rc = fmq_client_set_inbox (client, "./fmqclient");
     assert (rc >= 0);
 
+    //  Credit window bounds must make sense
+    rc = fmq_client_set_credit_window (client, 2000000, 1000000);
+    assert (rc != 0);
+    rc = fmq_client_set_credit_window (client, 1000000, 64000000);
+    assert (rc == 0);
+
+    //  Our server summarizes directories, so we ask for just what differs
+    rc = fmq_client_set_summaries (client, 1);
+    assert (rc == 0);
+
     //  Subscribe to the server's root
     rc = fmq_client_subscribe (client, "/");
     assert (rc >= 0);
@@ -538,6 +2058,16 @@ fmq_client_test (bool verbose)
     //  Get a reference to the msgpipe
     zsock_t *pipe = fmq_client_msgpipe (client);
 
+    //  The resync sends us only the file we didn't have
+    char *command, *inbox, *filename;
+    rc = zsock_recv (pipe, "sss", &command, &inbox, &filename);
+    assert (rc == 0);
+    assert (streq (command, "FILE UPDATED"));
+    assert (streq (filename, "missing.txt"));
+    zstr_free (&command);
+    zstr_free (&inbox);
+    zstr_free (&filename);
+
     //  Create and populate file that will be shared
     zfile_t *sfile = zfile_new ("./fmqserver", "test_file.txt");
     assert (sfile);
@@ -582,6 +2112,23 @@ fmq_client_test (bool verbose)
     fmq_client_destroy (&client);
     zsys_debug ("fmq_client_test: client destroyed");
 
+    //  The client stored the digest of the file it received, with no need
+    //  to read it back
+    zfile_t *mfile = zfile_new ("./fmqclient", "missing.txt");
+    char *expected = zsys_sprintf (" %s missing.txt\n", zfile_digest (mfile));
+    zfile_destroy (&mfile);
+    FILE *handle = fopen ("./fmqclient/" DIGESTS_FILE, "r");
+    assert (handle);
+    char line [256];
+    bool found = false;
+    while (fgets (line, sizeof (line), handle))
+        if (strlen (line) > strlen (expected)
+        &&  streq (line + strlen (line) - strlen (expected), expected))
+            found = true;
+    fclose (handle);
+    assert (found);
+    zstr_free (&expected);
+
     //  Kill the server
     zactor_destroy (&server);
     zsys_debug ("fmq_client_test: server destroyed");
@@ -589,6 +2136,11 @@ fmq_client_test (bool verbose)
     //  Delete the file the client has
     zfile_remove (cfile);
     zfile_destroy (&cfile);
+    for (index = 0; index < 6; index += 2)
+        zsys_file_delete ("%s/%s", paths [index], paths [index + 1]);
+    zsys_file_delete ("./fmqclient/missing.txt");
+    zsys_file_delete ("./fmqclient/" DIGESTS_FILE);
+    zsys_file_delete ("./fmqclient/" PROGRESS_FILE);
 
     //  Delete the directory used by the server
     rc = zsys_dir_delete ("./fmqserver");
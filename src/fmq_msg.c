@@ -43,6 +43,7 @@ struct _fmq_msg_t {
     size_t options_bytes;               //  Size of hash content
     zhash_t *cache;                     //  File SHA-1 signatures
     size_t cache_bytes;                 //  Size of hash content
+    zmsg_t *digests;                    //  Compact file SHA-1 signatures
     uint64_t credit;                    //  Credit, in bytes
     uint64_t sequence;                  //  Chunk sequence, 0 and up
     byte operation;                     //  Create=%d1 delete=%d2
@@ -52,6 +53,9 @@ struct _fmq_msg_t {
     zhash_t *headers;                   //  File properties
     size_t headers_bytes;               //  Size of hash content
     zchunk_t *chunk;                    //  Data chunk
+    zchunk_t *ranges;                   //  Byte ranges wanted
+    zchunk_t *names;                    //  Directories to summarize
+    zchunk_t *summary;                  //  Contents of directories
     char reason [256];                  //  Printable explanation, 255 characters
 };
 
@@ -231,9 +235,13 @@ fmq_msg_destroy (fmq_msg_t **self_p)
         free (self->path);
         zhash_destroy (&self->options);
         zhash_destroy (&self->cache);
+        zmsg_destroy (&self->digests);
         free (self->filename);
         zhash_destroy (&self->headers);
         zchunk_destroy (&self->chunk);
+        zchunk_destroy (&self->ranges);
+        zchunk_destroy (&self->names);
+        zchunk_destroy (&self->summary);
 
         //  Free object itself
         free (self);
@@ -334,6 +342,12 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
                     free (value);
                 }
             }
+            //  Get zero or more remaining frames
+            zmsg_destroy (&self->digests);
+            if (zsock_rcvmore (input))
+                self->digests = zmsg_recv (input);
+            else
+                self->digests = zmsg_new ();
             break;
 
         case FMQ_MSG_ICANHAZ_OK:
@@ -386,6 +400,65 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
         case FMQ_MSG_KTHXBAI:
             break;
 
+        case FMQ_MSG_CHEEZBURGERS:
+            GET_NUMBER8 (self->sequence);
+            {
+                size_t chunk_size;
+                GET_NUMBER4 (chunk_size);
+                if (self->needle + chunk_size > (self->ceiling)) {
+                    zsys_warning ("fmq_msg: chunk is missing data");
+                    goto malformed;
+                }
+                zchunk_destroy (&self->chunk);
+                self->chunk = zchunk_new (self->needle, chunk_size);
+                self->needle += chunk_size;
+            }
+            break;
+
+        case FMQ_MSG_MOAR:
+            GET_LONGSTR (self->filename);
+            {
+                size_t chunk_size;
+                GET_NUMBER4 (chunk_size);
+                if (self->needle + chunk_size > (self->ceiling)) {
+                    zsys_warning ("fmq_msg: ranges is missing data");
+                    goto malformed;
+                }
+                zchunk_destroy (&self->ranges);
+                self->ranges = zchunk_new (self->needle, chunk_size);
+                self->needle += chunk_size;
+            }
+            break;
+
+        case FMQ_MSG_ORLY:
+            GET_LONGSTR (self->path);
+            {
+                size_t chunk_size;
+                GET_NUMBER4 (chunk_size);
+                if (self->needle + chunk_size > (self->ceiling)) {
+                    zsys_warning ("fmq_msg: names is missing data");
+                    goto malformed;
+                }
+                zchunk_destroy (&self->names);
+                self->names = zchunk_new (self->needle, chunk_size);
+                self->needle += chunk_size;
+            }
+            break;
+
+        case FMQ_MSG_YARLY:
+            {
+                size_t chunk_size;
+                GET_NUMBER4 (chunk_size);
+                if (self->needle + chunk_size > (self->ceiling)) {
+                    zsys_warning ("fmq_msg: summary is missing data");
+                    goto malformed;
+                }
+                zchunk_destroy (&self->summary);
+                self->summary = zchunk_new (self->needle, chunk_size);
+                self->needle += chunk_size;
+            }
+            break;
+
         case FMQ_MSG_SRSLY:
             GET_STRING (self->reason);
             break;
@@ -483,6 +556,33 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
             if (self->chunk)
                 frame_size += zchunk_size (self->chunk);
             break;
+        case FMQ_MSG_CHEEZBURGERS:
+            frame_size += 8;            //  sequence
+            frame_size += 4;            //  Size is 4 octets
+            if (self->chunk)
+                frame_size += zchunk_size (self->chunk);
+            break;
+        case FMQ_MSG_MOAR:
+            frame_size += 4;
+            if (self->filename)
+                frame_size += strlen (self->filename);
+            frame_size += 4;            //  Size is 4 octets
+            if (self->ranges)
+                frame_size += zchunk_size (self->ranges);
+            break;
+        case FMQ_MSG_ORLY:
+            frame_size += 4;
+            if (self->path)
+                frame_size += strlen (self->path);
+            frame_size += 4;            //  Size is 4 octets
+            if (self->names)
+                frame_size += zchunk_size (self->names);
+            break;
+        case FMQ_MSG_YARLY:
+            frame_size += 4;            //  Size is 4 octets
+            if (self->summary)
+                frame_size += zchunk_size (self->summary);
+            break;
         case FMQ_MSG_SRSLY:
             frame_size += 1 + strlen (self->reason);
             break;
@@ -532,6 +632,7 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
             }
             else
                 PUT_NUMBER4 (0);    //  Empty hash
+            nbr_frames += self->digests? zmsg_size (self->digests): 0;
             break;
 
         case FMQ_MSG_NOM:
@@ -571,6 +672,65 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
                 PUT_NUMBER4 (0);    //  Empty chunk
             break;
 
+        case FMQ_MSG_CHEEZBURGERS:
+            PUT_NUMBER8 (self->sequence);
+            if (self->chunk) {
+                PUT_NUMBER4 (zchunk_size (self->chunk));
+                memcpy (self->needle,
+                        zchunk_data (self->chunk),
+                        zchunk_size (self->chunk));
+                self->needle += zchunk_size (self->chunk);
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty chunk
+            break;
+
+        case FMQ_MSG_MOAR:
+            if (self->filename) {
+                PUT_LONGSTR (self->filename);
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty string
+            if (self->ranges) {
+                PUT_NUMBER4 (zchunk_size (self->ranges));
+                memcpy (self->needle,
+                        zchunk_data (self->ranges),
+                        zchunk_size (self->ranges));
+                self->needle += zchunk_size (self->ranges);
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty chunk
+            break;
+
+        case FMQ_MSG_ORLY:
+            if (self->path) {
+                PUT_LONGSTR (self->path);
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty string
+            if (self->names) {
+                PUT_NUMBER4 (zchunk_size (self->names));
+                memcpy (self->needle,
+                        zchunk_data (self->names),
+                        zchunk_size (self->names));
+                self->needle += zchunk_size (self->names);
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty chunk
+            break;
+
+        case FMQ_MSG_YARLY:
+            if (self->summary) {
+                PUT_NUMBER4 (zchunk_size (self->summary));
+                memcpy (self->needle,
+                        zchunk_data (self->summary),
+                        zchunk_size (self->summary));
+                self->needle += zchunk_size (self->summary);
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty chunk
+            break;
+
         case FMQ_MSG_SRSLY:
             PUT_STRING (self->reason);
             break;
@@ -583,6 +743,18 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
     //  Now send the data frame
     zmq_msg_send (&frame, zsock_resolve (output), --nbr_frames? ZMQ_SNDMORE: 0);
 
+    //  Now send the message field if there is any
+    if (self->id == FMQ_MSG_ICANHAZ) {
+        if (self->digests) {
+            zframe_t *part = zmsg_first (self->digests);
+            while (part) {
+                zframe_send (&part, output,
+                    ZFRAME_REUSE + (--nbr_frames? ZFRAME_MORE: 0));
+                part = zmsg_next (self->digests);
+            }
+        }
+    }
+
     return 0;
 }
 
@@ -629,6 +801,11 @@ fmq_msg_print (fmq_msg_t *self)
                     item = (char *) zhash_next (self->cache);
                 }
             }
+            else
+                zsys_debug ("(NULL)");
+            zsys_debug ("    digests=");
+            if (self->digests)
+                zmsg_print (self->digests);
             else
                 zsys_debug ("(NULL)");
             break;
@@ -678,6 +855,35 @@ fmq_msg_print (fmq_msg_t *self)
             zsys_debug ("FMQ_MSG_KTHXBAI:");
             break;
 
+        case FMQ_MSG_CHEEZBURGERS:
+            zsys_debug ("FMQ_MSG_CHEEZBURGERS:");
+            zsys_debug ("    sequence=%ld", (long) self->sequence);
+            zsys_debug ("    chunk=[ ... ]");
+            break;
+
+        case FMQ_MSG_MOAR:
+            zsys_debug ("FMQ_MSG_MOAR:");
+            if (self->filename)
+                zsys_debug ("    filename='%s'", self->filename);
+            else
+                zsys_debug ("    filename=");
+            zsys_debug ("    ranges=[ ... ]");
+            break;
+
+        case FMQ_MSG_ORLY:
+            zsys_debug ("FMQ_MSG_ORLY:");
+            if (self->path)
+                zsys_debug ("    path='%s'", self->path);
+            else
+                zsys_debug ("    path=");
+            zsys_debug ("    names=[ ... ]");
+            break;
+
+        case FMQ_MSG_YARLY:
+            zsys_debug ("FMQ_MSG_YARLY:");
+            zsys_debug ("    summary=[ ... ]");
+            break;
+
         case FMQ_MSG_SRSLY:
             zsys_debug ("FMQ_MSG_SRSLY:");
             zsys_debug ("    reason='%s'", self->reason);
@@ -762,6 +968,18 @@ fmq_msg_command (fmq_msg_t *self)
         case FMQ_MSG_KTHXBAI:
             return ("KTHXBAI");
             break;
+        case FMQ_MSG_CHEEZBURGERS:
+            return ("CHEEZBURGERS");
+            break;
+        case FMQ_MSG_MOAR:
+            return ("MOAR");
+            break;
+        case FMQ_MSG_ORLY:
+            return ("ORLY");
+            break;
+        case FMQ_MSG_YARLY:
+            return ("YARLY");
+            break;
         case FMQ_MSG_SRSLY:
             return ("SRSLY");
             break;
@@ -858,6 +1076,39 @@ fmq_msg_set_cache (fmq_msg_t *self, zhash_t **cache_p)
 }
 
 
+//  --------------------------------------------------------------------------
+//  Get the digests field without transferring ownership
+
+zmsg_t *
+fmq_msg_digests (fmq_msg_t *self)
+{
+    assert (self);
+    return self->digests;
+}
+
+//  Get the digests field and transfer ownership to caller
+
+zmsg_t *
+fmq_msg_get_digests (fmq_msg_t *self)
+{
+    zmsg_t *digests = self->digests;
+    self->digests = NULL;
+    return digests;
+}
+
+//  Set the digests field, transferring ownership from caller
+
+void
+fmq_msg_set_digests (fmq_msg_t *self, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (msg_p);
+    zmsg_destroy (&self->digests);
+    self->digests = *msg_p;
+    *msg_p = NULL;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Get/set the credit field
 
@@ -1034,6 +1285,105 @@ fmq_msg_set_chunk (fmq_msg_t *self, zchunk_t **chunk_p)
 }
 
 
+//  --------------------------------------------------------------------------
+//  Get the ranges field without transferring ownership
+
+zchunk_t *
+fmq_msg_ranges (fmq_msg_t *self)
+{
+    assert (self);
+    return self->ranges;
+}
+
+//  Get the ranges field and transfer ownership to caller
+
+zchunk_t *
+fmq_msg_get_ranges (fmq_msg_t *self)
+{
+    zchunk_t *ranges = self->ranges;
+    self->ranges = NULL;
+    return ranges;
+}
+
+//  Set the ranges field, transferring ownership from caller
+
+void
+fmq_msg_set_ranges (fmq_msg_t *self, zchunk_t **chunk_p)
+{
+    assert (self);
+    assert (chunk_p);
+    zchunk_destroy (&self->ranges);
+    self->ranges = *chunk_p;
+    *chunk_p = NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Get the names field without transferring ownership
+
+zchunk_t *
+fmq_msg_names (fmq_msg_t *self)
+{
+    assert (self);
+    return self->names;
+}
+
+//  Get the names field and transfer ownership to caller
+
+zchunk_t *
+fmq_msg_get_names (fmq_msg_t *self)
+{
+    zchunk_t *names = self->names;
+    self->names = NULL;
+    return names;
+}
+
+//  Set the names field, transferring ownership from caller
+
+void
+fmq_msg_set_names (fmq_msg_t *self, zchunk_t **chunk_p)
+{
+    assert (self);
+    assert (chunk_p);
+    zchunk_destroy (&self->names);
+    self->names = *chunk_p;
+    *chunk_p = NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Get the summary field without transferring ownership
+
+zchunk_t *
+fmq_msg_summary (fmq_msg_t *self)
+{
+    assert (self);
+    return self->summary;
+}
+
+//  Get the summary field and transfer ownership to caller
+
+zchunk_t *
+fmq_msg_get_summary (fmq_msg_t *self)
+{
+    zchunk_t *summary = self->summary;
+    self->summary = NULL;
+    return summary;
+}
+
+//  Set the summary field, transferring ownership from caller
+
+void
+fmq_msg_set_summary (fmq_msg_t *self, zchunk_t **chunk_p)
+{
+    assert (self);
+    assert (chunk_p);
+    zchunk_destroy (&self->summary);
+    self->summary = *chunk_p;
+    *chunk_p = NULL;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Get/set the reason field
 
@@ -1118,6 +1468,9 @@ fmq_msg_test (bool verbose)
     zhash_t *icanhaz_cache = zhash_new ();
     zhash_insert (icanhaz_cache, "Name", "Brutus");
     fmq_msg_set_cache (self, &icanhaz_cache);
+    zmsg_t *icanhaz_digests = zmsg_new ();
+    fmq_msg_set_digests (self, &icanhaz_digests);
+    zmsg_addstr (fmq_msg_digests (self), "Captcha Diem");
     //  Send twice
     fmq_msg_send (self, output);
     fmq_msg_send (self, output);
@@ -1140,6 +1493,7 @@ fmq_msg_test (bool verbose)
         zhash_destroy (&cache);
         if (instance == 1)
             zhash_destroy (&icanhaz_cache);
+        assert (zmsg_size (fmq_msg_digests (self)) == 1);
     }
     fmq_msg_set_id (self, FMQ_MSG_ICANHAZ_OK);
 
@@ -1230,6 +1584,64 @@ fmq_msg_test (bool verbose)
         fmq_msg_recv (self, input);
         assert (fmq_msg_routing_id (self));
     }
+    fmq_msg_set_id (self, FMQ_MSG_CHEEZBURGERS);
+
+    fmq_msg_set_sequence (self, 123);
+    zchunk_t *cheezburgers_chunk = zchunk_new ("Captcha Diem", 12);
+    fmq_msg_set_chunk (self, &cheezburgers_chunk);
+    //  Send twice
+    fmq_msg_send (self, output);
+    fmq_msg_send (self, output);
+
+    for (instance = 0; instance < 2; instance++) {
+        fmq_msg_recv (self, input);
+        assert (fmq_msg_routing_id (self));
+        assert (fmq_msg_sequence (self) == 123);
+        assert (memcmp (zchunk_data (fmq_msg_chunk (self)), "Captcha Diem", 12) == 0);
+    }
+    fmq_msg_set_id (self, FMQ_MSG_MOAR);
+
+    fmq_msg_set_filename (self, "Life is short but Now lasts for ever");
+    zchunk_t *moar_ranges = zchunk_new ("Captcha Diem", 12);
+    fmq_msg_set_ranges (self, &moar_ranges);
+    //  Send twice
+    fmq_msg_send (self, output);
+    fmq_msg_send (self, output);
+
+    for (instance = 0; instance < 2; instance++) {
+        fmq_msg_recv (self, input);
+        assert (fmq_msg_routing_id (self));
+        assert (streq (fmq_msg_filename (self), "Life is short but Now lasts for ever"));
+        assert (memcmp (zchunk_data (fmq_msg_ranges (self)), "Captcha Diem", 12) == 0);
+    }
+    fmq_msg_set_id (self, FMQ_MSG_ORLY);
+
+    fmq_msg_set_path (self, "Life is short but Now lasts for ever");
+    zchunk_t *orly_names = zchunk_new ("Captcha Diem", 12);
+    fmq_msg_set_names (self, &orly_names);
+    //  Send twice
+    fmq_msg_send (self, output);
+    fmq_msg_send (self, output);
+
+    for (instance = 0; instance < 2; instance++) {
+        fmq_msg_recv (self, input);
+        assert (fmq_msg_routing_id (self));
+        assert (streq (fmq_msg_path (self), "Life is short but Now lasts for ever"));
+        assert (memcmp (zchunk_data (fmq_msg_names (self)), "Captcha Diem", 12) == 0);
+    }
+    fmq_msg_set_id (self, FMQ_MSG_YARLY);
+
+    zchunk_t *yarly_summary = zchunk_new ("Captcha Diem", 12);
+    fmq_msg_set_summary (self, &yarly_summary);
+    //  Send twice
+    fmq_msg_send (self, output);
+    fmq_msg_send (self, output);
+
+    for (instance = 0; instance < 2; instance++) {
+        fmq_msg_recv (self, input);
+        assert (fmq_msg_routing_id (self));
+        assert (memcmp (zchunk_data (fmq_msg_summary (self)), "Captcha Diem", 12) == 0);
+    }
     fmq_msg_set_id (self, FMQ_MSG_SRSLY);
 
     fmq_msg_set_reason (self, "Life is short but Now lasts for ever");
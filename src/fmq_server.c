@@ -22,6 +22,11 @@
 //  Include the zproject generated project header
 #include "filemq_classes.h"
 
+#if defined (__UTYPE_LINUX)
+#   include <sys/inotify.h>
+#   include <fcntl.h>
+#endif
+
 //  ---------------------------------------------------------------------------
 //  Forward declarations for the two main classes we use here
 
@@ -31,9 +36,76 @@ typedef struct _client_t client_t;
 //  Additional forward declarations
 typedef struct _sub_t sub_t;
 typedef struct _mount_t mount_t;
+typedef struct _update_t update_t;
+typedef struct _shared_t shared_t;
+typedef struct _cached_t cached_t;
+typedef struct _trie_t trie_t;
+typedef struct _worker_t worker_t;
 
-//  There's no point making these configurable
+//  Default chunk size, which can be set with fmq_server/chunk_size, or by
+//  the client with the chunk_size subscription option. Either can be set to
+//  "auto" to size chunks to a quarter of the client's credit window, so
+//  clients with a large window get large chunks and clients with a small
+//  window get small chunks with low latency.
 #define CHUNK_SIZE      1000000
+#define CHUNK_MIN       16384
+#define CHUNK_MAX       16000000
+
+//  Most chunks we send a client before we pause, so the reactor can serve
+//  other clients and sockets; change with fmq_server/dispatch_batch, where
+//  0 means no limit. This doesn't bound what we queue on the router; the
+//  client's credit does that.
+#define DISPATCH_BATCH  64
+
+//  When the kernel tells us about changes, a full rescan of each mount is
+//  only needed to catch anything it missed, so it can be infrequent. This
+//  can be changed with fmq_server/rescan_interval, in msecs.
+#define RESCAN_INTERVAL 60000
+
+//  Chunks of files being sent to more than one client are kept in memory,
+//  up to this many bytes; change with fmq_server/cache_size.
+#define CACHE_SIZE      (64 * CHUNK_SIZE)
+
+//  Files this big or bigger are digested in blocks, so clients that take
+//  deltas can ask for just the blocks they don't have. By default blocks
+//  are cut where the content says, between CDC_MIN and CDC_MAX and about
+//  DELTA_BLOCK on average, so blocks are found again after an insertion
+//  or in other files; fmq_server/delta_chunking set to "fixed" cuts them
+//  every DELTA_BLOCK bytes instead.
+#define DELTA_BLOCK     262144
+#define DELTA_MIN       (4 * DELTA_BLOCK)
+#define CDC_MIN         (DELTA_BLOCK / 4)
+#define CDC_MAX         (DELTA_BLOCK * 4)
+#define CDC_MASK        (0x3FFFFULL << 46)
+
+//  Default zstd compression level, for fmq_server/compress_level; we send
+//  chunks as they are if a sample has more entropy than ENTROPY_MAX, in
+//  1/256ths of a bit per byte.
+#define COMPRESS_LEVEL  3
+#define ENTROPY_MAX     (7 * 256 + 128)
+
+//  Most files each client worker keeps open
+#define WORKER_FILES    64
+
+//  Most messages we pass a client worker before it passes them back. Past
+//  this its clients wait for it to catch up, which keeps us well inside the
+//  high water mark of its pipe, where we and it would block on each other.
+#define WORKER_QUEUE    500
+
+//  Chunks of a file we ask the kernel to read ahead of the one we're
+//  sending; change with fmq_server/read_ahead, where 0 turns it off. This
+//  is only a hint: the reads themselves happen on the client workers,
+//  unless fmq_server/workers is 0, when they happen on the server thread.
+#define READ_AHEAD      4
+
+//  Changes we ask the kernel to tell us about, for each directory we watch
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                       | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+                       | IN_MOVE_SELF | IN_ONLYDIR)
+
+//  Digest we give files we haven't read yet, when telling clients what
+//  directories hold
+#define UNKNOWN_DIGEST  "0000000000000000000000000000000000000000"
 
 //  This structure defines the context for each running server. Store
 //  whatever properties and structures you need for the server.
@@ -45,7 +117,20 @@ struct _server_t {
     zconfig_t *config;          //  Current loaded configuration
 
     //  Properties not generated by gsl
+    zhash_t *clients;           //  Clients, by the id we gave them
+    uint last_id;               //  Last id we gave a client
     zlist_t *mounts;            //  Mount points
+    trie_t *aliases;            //  Mount points, by alias
+    zlist_t *hashers;           //  Hashing workers
+    zlist_t *idle_hashers;      //  Workers waiting for a job
+    zlist_t *hash_jobs;         //  Updates waiting for a worker
+    zlist_t *workers;           //  Client workers
+    zlist_t *paused;            //  Clients waiting to carry on sending
+    zsock_t *nudge;             //  Tells the reactor to carry them on
+    zsock_t *nudged;            //  Where the reactor hears it
+    zhash_t *cache;             //  Cached file chunks, by key
+    zlistx_t *cache_lru;        //  Unused cached chunks, oldest first
+    size_t cache_bytes;         //  Size of all cached chunks
 };
 
 //  ---------------------------------------------------------------------------
@@ -59,11 +144,33 @@ struct _client_t {
     fmq_msg_t *message;         //  Message in and out
 
     //  Properties not generated by gsl
+    char id [16];               //  Our id for the client
     uint64_t credit;            //  Credit remaining
-    zlist_t *patches;           //  Patches to send
-    zdir_patch_t *patch;        //  Current patch
+    uint64_t window;            //  Credit after client's last grant
+    size_t chunk_size;          //  Chunk size for this client
+    bool chunk_auto;            //  Size chunks to client's credit window?
+    bool bundle;                //  Client takes small files in bundles?
+    bool delta;                 //  Client takes block digests of files?
+    bool compress;              //  Client takes compressed chunks?
+    bool local;                 //  Client copies chunks from our files?
+    worker_t *worker;           //  Worker reading our chunks, if any
+    size_t unread;              //  Chunk size for the worker to read
+    size_t batched;             //  Chunks sent since we last paused
+    bool paused;                //  Waiting for the reactor to carry on?
+    zhash_t *deltas;            //  Updates waiting for MOAR, by virtual path
+    zhash_t *wanted;            //  Ranges asked for with MOAR, by virtual path
+    zhash_t *resume;            //  Bytes and digest of files client has
+                                //  part of, by virtual path
+    zchunk_t *ranges;           //  Ranges wanted of current file, if any
+    size_t range;               //  Index of current range
+    zlistx_t *patches;          //  Updates to send, in order
+    zhash_t *queued;            //  Queued updates, by virtual path
+    update_t *update;           //  Current update
     zfile_t *file;              //  Current file we're sending
+    bool fresh;                 //  Next chunk is the first of the file?
+    cached_t *cached;           //  Cached chunk we last sent, if any
     off_t offset;               //  Offset of next read in file
+    off_t advised;              //  End of what we asked to read ahead
     uint64_t sequence;          //  Sequence number for chunck
 };
 
@@ -71,420 +178,2866 @@ struct _client_t {
 #include "fmq_server_engine.inc"
 
 //  ---------------------------------------------------------------------------
-//  Subscription object
+//  Shared chunk, which messages send without copying it. Each message gets
+//  a chunk that refers to our data and drops its link when destroyed, which
+//  may be on a client worker, so links are counted atomically. The data is
+//  freed when the owner and all the messages have let go of it.
 //
 
-struct _sub_t {
-    client_t *client;           //  Always refers to live client
-    char *path;                 //  Path client is subscribed to
-    zhash_t *cache;             //  Client's cache list
+struct _shared_t {
+    zchunk_t *chunk;            //  Chunk data
+    void *links;                //  Owner and messages holding the data
 };
 
 //  --------------------------------------------------------------------------
-//  Constructor for the sub (a.k.a. subscription) class
+//  Constructor for the shared class, takes ownership of the chunk
 //
 
-static sub_t *
-sub_new (client_t *client, const char *path, zhash_t *cache)
+static shared_t *
+shared_new (zchunk_t **chunk_p)
 {
-    sub_t *self = (sub_t *) zmalloc (sizeof (sub_t));
-    self->client = client;
-    self->path = strdup (path);
-    self->cache = zhash_dup (cache);
-
-    //  Cached filenames may be local, in which case prefix them with
-    //  the subscription path so we can do a consistent match.
-
-    sub_t *cache_item = (sub_t *) zhash_first (self->cache);
-    while (cache_item) {
-        char *key = (char *) zhash_cursor (self->cache);
-        if (*key != '/') {
-            size_t new_key_len = strlen (self->path) + strlen (key) + 2;
-            char *new_key = (char *) calloc (new_key_len, sizeof (char));
-            snprintf (new_key, new_key_len, "%s/%s", self->path, key);
-            zsys_debug ("sub_new: new_key=%s", new_key);
-            zhash_rename (self->cache, key, new_key);
-            free (new_key);
-        }
-        cache_item = (sub_t *) zhash_next (self->cache);
-    }
+    assert (chunk_p);
+    shared_t *self = (shared_t *) zmalloc (sizeof (shared_t));
+    self->chunk = *chunk_p;
+    self->links = zmq_atomic_counter_new ();
+    zmq_atomic_counter_inc (self->links);
+    *chunk_p = NULL;
     return self;
 }
 
 //  --------------------------------------------------------------------------
-//  Destructor for the sub (a.k.a subscription) class
+//  Drop a link to the shared chunk, and destroy it when that was the last
 //
 
 static void
-sub_destroy (sub_t **self_p)
+shared_destroy (shared_t **self_p)
 {
     assert (self_p);
     if (*self_p) {
-        sub_t *self = *self_p;
-        zhash_destroy (&self->cache);
-        free (self->path);
-        free (self);
+        shared_t *self = *self_p;
+        if (zmq_atomic_counter_dec (self->links) == 0) {
+            zchunk_destroy (&self->chunk);
+            zmq_atomic_counter_destroy (&self->links);
+            free (self);
+        }
         *self_p = NULL;
     }
 }
 
+static void
+s_shared_free (void **argument)
+{
+    shared_t *self = (shared_t *) *argument;
+    shared_destroy (&self);
+}
 
 //  --------------------------------------------------------------------------
-//  Add patch to sub client patches list
+//  Return a new chunk, for a message, that refers to the shared data
 //
 
-static void
-sub_patch_add (sub_t *self, zdir_patch_t *patch)
+static zchunk_t *
+shared_chunk (shared_t *self)
 {
-    //  Debug print where we are and information on the incoming patch
-    zsys_debug ("@@ sub_patch_add, incoming patch info below");
-    zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
-        zdir_patch_op (patch), zdir_patch_vpath (patch));
-
-    //  Skip file creation if client already has identical file
-    //  Populate the digest for the associated patch
-    zdir_patch_digest_set (patch);
-    if (zdir_patch_op (patch) == patch_create) {
-        char *digest = (char *) zhash_lookup (self->cache,
-                        zdir_patch_vpath (patch) + strlen(self->path) + 1);
-        if (digest && streq (digest, zdir_patch_digest (patch))) {
-            zsys_debug ("sub_patch_add: skipping patch");
-            return;             //  Just skip patch for this client
-        }
-    }
-    //  Remove any previous patches for the same file
-    zdir_patch_t *existing = (zdir_patch_t *) zlist_first (self->client->patches);
-    while (existing) {
-        if (streq (zdir_patch_vpath (patch), zdir_patch_vpath (existing))) {
-            zsys_debug ("!!! removing patch !!!");
-            zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (existing),
-                zdir_patch_op (existing), zdir_patch_vpath (existing));
-            zlist_remove (self->client->patches, existing);
-            zdir_patch_destroy (&existing);
-            break;
-        }
-        existing = (zdir_patch_t *) zlist_next (self->client->patches);
-    }
-    if (zdir_patch_op (patch) == patch_create) {
-        zsys_debug ("---> inserting patch <---");
-        zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
-            zdir_patch_op (patch), zdir_patch_vpath (patch));
-        zhash_insert (self->cache,
-            zdir_patch_digest (patch), (void *) zdir_patch_vpath (patch));
-    }
+    zmq_atomic_counter_inc (self->links);
+    return zchunk_frommem (zchunk_data (self->chunk), zchunk_size (self->chunk),
+                           s_shared_free, self);
+}
 
-    zsys_debug ("+++ adding following patch to client list +++");
-    zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
-        zdir_patch_op (patch), zdir_patch_vpath (patch));
+//  --------------------------------------------------------------------------
+//  Return the size of the shared data
+//
 
-    //  Track that we've queued patch for client, so we don't do it twice
-    zdir_patch_t *patch_add = zdir_patch_dup (patch);
-    if (patch_add) {
-        int rc = zlist_append (self->client->patches, (void *) patch_add);
-        if (rc != 0)
-            zsys_error ("unable to append new patch +++");
-    }
-    else
-        zsys_error ("unable to duplicate patch");
+static size_t
+shared_size (shared_t *self)
+{
+    return zchunk_size (self->chunk);
 }
 
-//  --------------------------------------------------------------------------
-//  Mount point in memory
+
+//  ---------------------------------------------------------------------------
+//  Update object, a patch that is shared by all the clients it was queued
+//  for, so we copy and digest each patch only once however many clients
+//  are subscribed.
 //
 
-struct _mount_t {
-    char *location;         //  Physical location
-    char *alias;            //  Alias into our tree
-    zdir_t *dir;            //  Directory snapshot
-    zlist_t *subs;          //  Client subscriptions
+struct _update_t {
+    mount_t *mount;             //  Mount the patch came from
+    zdir_patch_t *patch;        //  Patch to send
+    char *digest;               //  File digest, if known
+    shared_t *blocks;           //  Digest of each block of file, if known
+    sub_t *sub;                 //  Only subscriber to send to, if any
+    bool orphan;                //  That subscriber went away
+    bool hashing;               //  Waiting for a worker to digest file
+    size_t links;               //  Number of references to update
 };
 
 //  --------------------------------------------------------------------------
-//  Constructor for the mount class
-//  Loads directory tree if possible
+//  Constructor for the update class, takes ownership of the patch
 //
 
-static mount_t *
-mount_new (char *location, char *alias)
+static update_t *
+update_new (mount_t *mount, zdir_patch_t **patch_p)
 {
-    //  Mount path must start with '/'
-    //  We'll do better error handling later
-    assert (*alias == '/');
-
-    mount_t *self = (mount_t *) zmalloc (sizeof (mount_t));
-    self->location = strdup (location);
-    self->alias = strdup (alias);
-    self->dir = zdir_new (self->location, NULL);
-    self->subs = zlist_new ();
+    assert (patch_p);
+    update_t *self = (update_t *) zmalloc (sizeof (update_t));
+    self->mount = mount;
+    self->patch = *patch_p;
+    self->links = 1;
+    *patch_p = NULL;
     return self;
 }
 
+//  --------------------------------------------------------------------------
+//  Take another reference to the update
+//
+
+static update_t *
+update_link (update_t *self)
+{
+    assert (self);
+    self->links++;
+    return self;
+}
 
 //  --------------------------------------------------------------------------
-//  Destructor for the mount class
+//  Drop a reference to the update, and destroy it when that was the last
 //
 
 static void
-mount_destroy (mount_t **self_p)
+update_destroy (update_t **self_p)
 {
     assert (self_p);
     if (*self_p) {
-        mount_t *self = *self_p;
-        free (self->location);
-        free (self->alias);
-        //  Destroy subscriptions
-        while (zlist_size (self->subs)) {
-            sub_t *sub = (sub_t *) zlist_pop (self->subs);
-            sub_destroy (&sub);
+        update_t *self = *self_p;
+        if (--self->links == 0) {
+            zdir_patch_destroy (&self->patch);
+            free (self->digest);
+            shared_destroy (&self->blocks);
+            free (self);
         }
-        zlist_destroy (&self->subs);
-        zdir_destroy (&self->dir);
-        free (self);
         *self_p = NULL;
     }
 }
 
-
-//  --------------------------------------------------------------------------
-//  Reloads directory tree and returns true if activity, false if the same
-//
-
-static bool
-mount_refresh (mount_t *self, server_t *server)
+static void
+s_update_free (void *argument)
 {
-    zsys_debug ("mount_refresh: checking for changes to mount point");
-    bool activity = false;
+    update_t *self = (update_t *) argument;
+    update_destroy (&self);
+}
 
-    //  Get latest snapshot and build a patches list for any changes
-    //  Load the server local path, no parent dir.
-    zdir_t *latest = zdir_new (self->location, NULL);
-    zsys_debug ("mount_refresh: old dir");
-    zdir_print (self->dir, 2);
-    zsys_debug ("mount_refresh: new dir");
-    zdir_print (latest, 2);
-    //  Get list of patches using old and new dir with location as seen by
-    //  the client.
-    zlist_t *patches = zdir_diff (self->dir, latest, self->alias);
+static void
+s_chunk_free (void *argument)
+{
+    zchunk_t *self = (zchunk_t *) argument;
+    zchunk_destroy (&self);
+}
 
-    //  Go through the patches just received and print information about them
-    zdir_patch_t *tmppatch = (zdir_patch_t *) zlist_first (patches);
-    while (tmppatch) {
-        zsys_debug ("--- patch=%s, vpath=%s, op=%d", zdir_patch_path (tmppatch),
-            zdir_patch_vpath (tmppatch), zdir_patch_op (tmppatch));
-        zfile_t *tmpfile = zdir_patch_file (tmppatch);
-        zsys_debug ("----- file name=%s", zfile_filename (tmpfile, NULL));
-        tmppatch = (zdir_patch_t *) zlist_next (patches);
-    }
+static void
+s_file_free (void *argument)
+{
+    zfile_t *self = (zfile_t *) argument;
+    zfile_destroy (&self);
+}
 
-    //  Drop old directory and replace with latest version
-    zdir_destroy (&self->dir);
-    self->dir = latest;
 
-    //  Copy new patches to clients' patches list
-    sub_t *sub = (sub_t *) zlist_first (self->subs);
-    while (sub) {
-        zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
-        while (patch) {
-            sub_patch_add (sub, patch);
-            patch = (zdir_patch_t *) zlist_next (patches);
-            activity = true;
-        }
-        sub = (sub_t *) zlist_next (self->subs);
-    }
+//  ---------------------------------------------------------------------------
+//  Read size bytes of file at offset into a new chunk. Returns NULL if we
+//  can't read them all, as the file shrank under us.
 
-    //  Destroy patches, they've all been copied
-    while (zlist_size (patches)) {
-        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
-        zdir_patch_destroy (&patch);
+static zchunk_t *
+s_file_read (zfile_t *file, size_t size, off_t offset)
+{
+    zchunk_t *chunk = zfile_read (file, size, offset);
+    if (!chunk || zchunk_size (chunk) < size) {
+        zsys_warning ("fmq_server: short read on %s",
+                      zfile_filename (file, NULL));
+        zchunk_destroy (&chunk);
     }
-    zlist_destroy (&patches);
-    return activity;
+    return chunk;
 }
 
 
-//  --------------------------------------------------------------------------
-//  Store subscription for mount point
-//
+//  ---------------------------------------------------------------------------
+//  Turn a file message into one telling the client we couldn't read its
+//  chunk, which stands for size bytes of credit. The client drops what it
+//  has of the file; we send the file again once we see it change.
 
 static void
-mount_sub_store (mount_t *self, client_t *client, fmq_msg_t *request)
+s_msg_set_failed (fmq_msg_t *message, size_t size)
 {
-    assert (self);
-    assert (self->subs);
-
-    //  Store subscription along with any previous ones
-    //  Coalesce subscriptions that are on same path
-    const char *path = fmq_msg_path (request);
-    sub_t *sub = (sub_t *) zlist_first (self->subs);
-    while (sub) {
-        if (client == sub->client) {
-            //  If old subscription is superset/same as new, ignore new
-            if (strncmp (path, sub->path, strlen (sub->path)) == 0) {
-                zsys_debug ("new subscription already exists");
-                return;
-            }
-            else
-            //  If new subscription is superset of old one, remove old
-            if (strncmp (sub->path, path, strlen (path)) == 0) {
-                zsys_debug ("superset, sub->path=%s, path=%s",
-                    sub->path, path);
-                zlist_remove (self->subs, sub);
-                sub_destroy (&sub);
-                sub = (sub_t *) zlist_first (self->subs);
-            }
-            else
-                sub = (sub_t *) zlist_next (self->subs);
-        }
-        else
-            sub = (sub_t *) zlist_next (self->subs);
-    }
-    //  New subscription for this client, append to our list
-    sub = sub_new (client, path, fmq_msg_cache (request));
-    zlist_append (self->subs, sub);
-
-    //  If client requested resync, send full mount contents now
-    /*
-    if (fmq_msg_options_number (client->message, "RESYNC", 0) == 1) {
-        zlist_t *patches = zdir_resync (self->dir, self->alias);
-        while (zlist_size (patches)) {
-            zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
-            sub_patch_add (sub, patch);
-            zdir_patch_destroy (&patch);
-        }
-        zlist_destroy (&patches);
+    zhash_t *headers = fmq_msg_get_headers (message);
+    if (!headers) {
+        headers = zhash_new ();
+        zhash_autofree (headers);
     }
-    */
+    char value [32];
+    snprintf (value, sizeof (value), "%zu", size);
+    zhash_update (headers, "failed", "1");
+    zhash_update (headers, "length", value);
+    fmq_msg_set_headers (message, &headers);
+    zchunk_t *chunk = zchunk_new (NULL, 0);
+    fmq_msg_set_chunk (message, &chunk);
 }
 
 
-//  --------------------------------------------------------------------------
-//  Purge subscriptions for a specified client
-//
+//  ---------------------------------------------------------------------------
+//  Move the fields of a file message, CHEEZBURGER or CHEEZBURGERS, from
+//  one message to another.
 
 static void
-mount_sub_purge (mount_t *self, client_t *client)
+s_msg_move (fmq_msg_t *self, fmq_msg_t *source)
 {
-    sub_t *sub = (sub_t *) zlist_first (self->subs);
-    while (sub) {
-        if (sub->client == client) {
-            sub_t *next = (sub_t *) zlist_next (self->subs);
-            zlist_remove (self->subs, sub);
-            sub_destroy (&sub);
-            sub = next;
-        }
-        else
-            sub = (sub_t *) zlist_next (self->subs);
-    }
+    fmq_msg_set_id (self, fmq_msg_id (source));
+    fmq_msg_set_sequence (self, fmq_msg_sequence (source));
+    fmq_msg_set_operation (self, fmq_msg_operation (source));
+    fmq_msg_set_filename (self, fmq_msg_filename (source));
+    fmq_msg_set_offset (self, fmq_msg_offset (source));
+    fmq_msg_set_eof (self, fmq_msg_eof (source));
+    zhash_t *headers = fmq_msg_get_headers (source);
+    fmq_msg_set_headers (self, &headers);
+    zchunk_t *chunk = fmq_msg_get_chunk (source);
+    fmq_msg_set_chunk (self, &chunk);
 }
 
+
 //  ---------------------------------------------------------------------------
-//  Monitor the servers published directories for changes
+//  Cached chunk of a file, shared by all clients sending the file so that
+//  we read it from disk only once. Chunks in use are held with links;
+//  unused chunks wait in the server's LRU list until evicted.
 //
 
-static int
-monitor_the_server (zloop_t *loop, int timer_id, void *arg)
-{
-    server_t *self = (server_t *) arg;
-    bool activity = false;
-    mount_t *mount = (mount_t *) zlist_first (self->mounts);
-    while (mount) {
-        if (mount_refresh (mount, self))
-            activity = true;
-        mount = (mount_t *) zlist_next (self->mounts);
-    }
-    if (activity)
-        engine_broadcast_event (self, NULL, dispatch_event);
-
-    return 0;
-}
-
-//  Allocate properties and structures for a new server instance.
-//  Return 0 if OK, or -1 if there was an error.
+struct _cached_t {
+    char *key;                  //  File, modified, size, and offset
+    shared_t *chunk;            //  Chunk data
+    size_t links;               //  Number of clients using chunk
+    void *handle;               //  Handle in LRU list, when unused
+};
 
-static int
-server_initialize (server_t *self)
+static void
+s_cached_free (void *argument)
 {
-    //  Construct properties here
-    zsys_notice ("starting filemq service");
-    self->mounts = zlist_new ();
-    //  Register with the engine a function that will be called
-    //  every second by the engine.
-    engine_set_monitor (self, 1000, monitor_the_server);
-    return 0;
+    cached_t *self = (cached_t *) argument;
+    shared_destroy (&self->chunk);
+    free (self->key);
+    free (self);
 }
 
-//  Free properties and structures for a server instance
+//  --------------------------------------------------------------------------
+//  Drop cached chunks that nobody is using until the cache fits its budget
 
 static void
-server_terminate (server_t *self)
+server_cache_trim (server_t *self)
 {
-    //  Destroy properties here
-    zsys_notice ("terminating filemq service");
-    while (zlist_size (self->mounts)) {
-        mount_t *mount = (mount_t *) zlist_pop (self->mounts);
-        mount_destroy (&mount);
+    char *value = zconfig_resolve (self->config, "fmq_server/cache_size", NULL);
+    size_t limit = value? (size_t) atol (value): CACHE_SIZE;
+    while (self->cache_bytes > limit && zlistx_size (self->cache_lru)) {
+        cached_t *cached = (cached_t *) zlistx_detach (self->cache_lru, NULL);
+        self->cache_bytes -= shared_size (cached->chunk);
+        zhash_delete (self->cache, cached->key);
     }
-    zlist_destroy (&self->mounts);
 }
 
-//  Process server API method, return reply message if any
+//  --------------------------------------------------------------------------
+//  Look up a chunk in the cache, returning a link to it, or NULL if it is
+//  not cached
 
-static zmsg_t *
-server_method (server_t *self, const char *method, zmsg_t *msg)
+static cached_t *
+server_cache_lookup (server_t *self, const char *key)
 {
-    if (streq (method, "PUBLISH")) {
-        char *location = zmsg_popstr (msg);
-        char *alias = zmsg_popstr (msg);
-        mount_t *mount = mount_new (location, alias);
-        zmsg_t *ret_msg = zmsg_new ();
-        if (mount) {
-            zlist_append (self->mounts, mount);
-            zmsg_addstr (ret_msg, "SUCCESS");
-        }
-        else
-            zmsg_addstr (ret_msg, "FAILURE");
-        free (location);
-        free (alias);
-        return ret_msg;
+    cached_t *cached = (cached_t *) zhash_lookup (self->cache, key);
+    if (cached && cached->links++ == 0) {
+        zlistx_detach (self->cache_lru, cached->handle);
+        cached->handle = NULL;
     }
-
-    return NULL;
+    return cached;
 }
 
+//  --------------------------------------------------------------------------
+//  Add a chunk to the cache, taking ownership of it, and return a link to
+//  the cached chunk
 
-//  Allocate properties and structures for a new client connection and
-//  optionally engine_set_next_event (). Return 0 if OK, or -1 on error.
-
-static int
-client_initialize (client_t *self)
+static cached_t *
+server_cache_store (server_t *self, const char *key, zchunk_t **chunk_p)
 {
-    //  Construct properties here
-    self->patches = zlist_new ();
-    return 0;
+    assert (chunk_p);
+    cached_t *cached = (cached_t *) zmalloc (sizeof (cached_t));
+    cached->key = strdup (key);
+    cached->chunk = shared_new (chunk_p);
+    cached->links = 1;
+    zhash_insert (self->cache, key, cached);
+    zhash_freefn (self->cache, key, s_cached_free);
+    self->cache_bytes += shared_size (cached->chunk);
+    server_cache_trim (self);
+    return cached;
 }
 
-//  Free properties and structures for a client connection
+//  --------------------------------------------------------------------------
+//  Drop a link to a cached chunk; unused chunks become candidates for
+//  eviction
 
 static void
-client_terminate (client_t *self)
+server_cache_release (server_t *self, cached_t **cached_p)
 {
-    //  Destroy properties here
-    mount_t *mount = (mount_t *) zlist_first (self->server->mounts);
-    while (mount) {
-        mount_sub_purge (mount, self);
-        mount = (mount_t *) zlist_next (self->server->mounts);
-    }
-    while (zlist_size (self->patches)) {
-        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (self->patches);
-        zdir_patch_destroy (&patch);
+    assert (cached_p);
+    cached_t *cached = *cached_p;
+    if (cached && --cached->links == 0) {
+        cached->handle = zlistx_add_end (self->cache_lru, cached);
+        server_cache_trim (self);
     }
-    zlist_destroy (&self->patches);
-    zdir_patch_destroy (&self->patch);
-    zfile_destroy (&self->file);
+    *cached_p = NULL;
 }
 
 //  ---------------------------------------------------------------------------
-//  Selftest
+//  Path trie, holds mounts or subscriptions by path with a node per path
+//  component, so we can find everything at or above a path, or at or below
+//  it, in time that depends on the length of the path and not on how many
+//  mounts or subscriptions we have.
+//
+
+struct _trie_t {
+    trie_t *parent;             //  Node above this one, if any
+    char *name;                 //  Path component, in parent's children
+    zhash_t *children;          //  Nodes below this one, if any
+    zlist_t *items;             //  Items at this path, if any
+};
+
+//  --------------------------------------------------------------------------
+//  Constructor for the trie class; the root has no parent and no name
+//
+
+static trie_t *
+trie_new (trie_t *parent, const char *name)
+{
+    trie_t *self = (trie_t *) zmalloc (sizeof (trie_t));
+    self->parent = parent;
+    self->name = strdup (name);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destructor for the trie class, destroys the nodes below it but not the
+//  items it holds
+//
+
+static void
+trie_destroy (trie_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        trie_t *self = *self_p;
+        trie_t *child = self->children?
+            (trie_t *) zhash_first (self->children): NULL;
+        while (child) {
+            trie_destroy (&child);
+            child = (trie_t *) zhash_next (self->children);
+        }
+        zhash_destroy (&self->children);
+        zlist_destroy (&self->items);
+        free (self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Step from a node to the child for the next component of a path, which
+//  we copy into name, creating the child if asked. Returns NULL at the end
+//  of the path, or if there is no such child.
+//
+
+static trie_t *
+trie_step (trie_t *self, const char **path_p, char *name, bool create)
+{
+    *path_p += strspn (*path_p, "/");
+    size_t length = strcspn (*path_p, "/");
+    if (length == 0)
+        return NULL;
+    memcpy (name, *path_p, length);
+    name [length] = 0;
+    *path_p += length;
+
+    trie_t *child = self->children?
+        (trie_t *) zhash_lookup (self->children, name): NULL;
+    if (!child && create) {
+        if (!self->children)
+            self->children = zhash_new ();
+        child = trie_new (self, name);
+        zhash_insert (self->children, name, child);
+    }
+    return child;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the node for a path, or NULL if there is none; if create is true,
+//  create it and any nodes above it that are missing.
+//
+
+static trie_t *
+trie_node (trie_t *self, const char *path, bool create)
+{
+    char *name = (char *) zmalloc (strlen (path) + 1);
+    while (self) {
+        path += strspn (path, "/");
+        if (!*path)
+            break;
+        self = trie_step (self, &path, name, create);
+    }
+    free (name);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Add an item at a path
+//
+
+static void
+trie_insert (trie_t *self, const char *path, void *item)
+{
+    trie_t *node = trie_node (self, path, true);
+    if (!node->items)
+        node->items = zlist_new ();
+    zlist_append (node->items, item);
+}
+
+//  --------------------------------------------------------------------------
+//  Remove an item from a path, and prune any nodes left empty
+//
+
+static void
+trie_remove (trie_t *self, const char *path, void *item)
+{
+    trie_t *node = trie_node (self, path, false);
+    if (node && node->items)
+        zlist_remove (node->items, item);
+    while (node && node->parent
+    &&    (!node->items || zlist_size (node->items) == 0)
+    &&    (!node->children || zhash_size (node->children) == 0)) {
+        trie_t *parent = node->parent;
+        zhash_delete (parent->children, node->name);
+        trie_destroy (&node);
+        node = parent;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Append to a list the items at a path and at every path above it
+//
+
+static void
+trie_match (trie_t *self, const char *path, zlist_t *matches)
+{
+    char *name = (char *) zmalloc (strlen (path) + 1);
+    while (self) {
+        void *item = self->items? zlist_first (self->items): NULL;
+        while (item) {
+            zlist_append (matches, item);
+            item = zlist_next (self->items);
+        }
+        self = trie_step (self, &path, name, false);
+    }
+    free (name);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first item at the longest path that is a path or above it,
+//  or NULL if there is none
+//
+
+static void *
+trie_longest (trie_t *self, const char *path)
+{
+    void *longest = NULL;
+    char *name = (char *) zmalloc (strlen (path) + 1);
+    while (self) {
+        if (self->items && zlist_size (self->items))
+            longest = zlist_first (self->items);
+        self = trie_step (self, &path, name, false);
+    }
+    free (name);
+    return longest;
+}
+
+//  --------------------------------------------------------------------------
+//  Append to a list the items at a path and at every path below it
+//
+
+static void
+trie_within (trie_t *self, const char *path, zlist_t *matches)
+{
+    trie_t *node = trie_node (self, path, false);
+    if (!node)
+        return;
+    void *item = node->items? zlist_first (node->items): NULL;
+    while (item) {
+        zlist_append (matches, item);
+        item = zlist_next (node->items);
+    }
+    trie_t *child = node->children?
+        (trie_t *) zhash_first (node->children): NULL;
+    while (child) {
+        trie_within (child, "", matches);
+        child = (trie_t *) zhash_next (node->children);
+    }
+}
+
+//  ---------------------------------------------------------------------------
+//  Subscription object
+//
+
+struct _sub_t {
+    client_t *client;           //  Always refers to live client
+    char *path;                 //  Path client is subscribed to
+    zhash_t *cache;             //  Client's cache list
+    zlist_t *include;           //  Patterns of files to send, if any
+    zlist_t *exclude;           //  Patterns of files not to send, if any
+};
+
+//  --------------------------------------------------------------------------
+//  Return the virtual path of a name relative to a subscription path, or
+//  the path itself if the name is empty. Caller frees the result.
+//
+
+static char *
+s_vpath_join (const char *path, const char *name)
+{
+    size_t length = strlen (path);
+    bool slash = length && path [length - 1] == '/';
+    return *name? zsys_sprintf ("%s%s%s", path, slash? "": "/", name)
+                : strdup (path);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Store the digest of a file the client has. Cached filenames may be
+//  local, in which case prefix them with the subscription path, so we can
+//  match them with virtual paths.
+//
+
+static void
+sub_cache_store (sub_t *self, const char *filename, const char *digest)
+{
+    if (*filename == '/')
+        zhash_update (self->cache, filename, (char *) digest);
+    else {
+        char *vpath = s_vpath_join (self->path, filename);
+        zhash_update (self->cache, vpath, (char *) digest);
+        zstr_free (&vpath);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Constructor for the sub (a.k.a. subscription) class. The client may
+//  send its cache as a hash, or in compact form as frames of entries,
+//  which we read straight into our own cache.
+//
+
+static sub_t *
+sub_new (client_t *client, const char *path, zhash_t *cache, zmsg_t *digests)
+{
+    sub_t *self = (sub_t *) zmalloc (sizeof (sub_t));
+    self->client = client;
+    self->path = strdup (path);
+    self->cache = zhash_new ();
+    zhash_autofree (self->cache);
+
+    char *digest = cache? (char *) zhash_first (cache): NULL;
+    while (digest) {
+        sub_cache_store (self, zhash_cursor (cache), digest);
+        digest = (char *) zhash_next (cache);
+    }
+    //  Each entry is a 2-octet count of octets shared with the filename
+    //  before it, a 2-octet size and that many octets of filename, and a
+    //  20-octet digest. Frames are independent of each other.
+    char *filename = digests? (char *) zmalloc (0x10000): NULL;
+    zframe_t *part = digests? zmsg_first (digests): NULL;
+    while (part) {
+        const byte *needle = zframe_data (part);
+        const byte *ceiling = needle + zframe_size (part);
+        size_t length = 0;
+        while (needle < ceiling) {
+            size_t shared = 0, size = 0;
+            if (needle + 4 <= ceiling) {
+                shared = (needle [0] << 8) + needle [1];
+                size = (needle [2] << 8) + needle [3];
+                needle += 4;
+            }
+            if (needle + size + 20 > ceiling
+            ||  shared > length || shared + size > 0xFFFF) {
+                zsys_warning ("sub_new: malformed digests, ignored");
+                break;
+            }
+            memcpy (filename + shared, needle, size);
+            length = shared + size;
+            filename [length] = 0;
+            needle += size;
+
+            char hex [41];
+            int index;
+            for (index = 0; index < 20; index++)
+                snprintf (hex + index * 2, 3, "%02X", needle [index]);
+            needle += 20;
+            sub_cache_store (self, filename, hex);
+        }
+        part = zmsg_next (digests);
+    }
+    free (filename);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destructor for the sub (a.k.a subscription) class
+//
+
+static void
+sub_destroy (sub_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        sub_t *self = *self_p;
+        zhash_destroy (&self->cache);
+        zlist_destroy (&self->include);
+        zlist_destroy (&self->exclude);
+        free (self->path);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Match a glob pattern against a path: '*' matches any characters except
+//  '/', "**" matches any characters, and '?' matches any one character
+//  except '/'. A "**/" at the start or after a '/' matches any number of
+//  whole directories, including none, so "**/foo" matches "foo". Patterns
+//  come from clients, so we don't recurse: on a mismatch we go back to the
+//  last star and let it take one more character. A '*' can't take a '/',
+//  so then we go back to the last "**" instead, or for "**/", to the next
+//  directory; stars before that one can't do better than it.
+//
+
+static bool
+s_glob_match (const char *pattern, const char *string)
+{
+    const char *start = pattern;
+    const char *star = NULL;            //  Pattern after the last '*'
+    const char *star_at = NULL;         //  Where that '*' ends for now
+    const char *any = NULL;             //  Pattern after the last "**"
+    const char *any_at = NULL;          //  Where that "**" ends for now
+    bool dirs = false;                  //  That "**" takes directories?
+    while (*string) {
+        if (*pattern == '*') {
+            if (pattern [1] == '*') {
+                dirs = pattern [2] == '/'
+                    && (pattern == start || pattern [-1] == '/');
+                pattern += dirs? 3: 2;
+                any = pattern;
+                any_at = string;
+                star = NULL;
+            }
+            else {
+                pattern++;
+                star = pattern;
+                star_at = string;
+            }
+        }
+        else
+        if (*pattern
+        && (*pattern == '?'? *string != '/': *pattern == *string)) {
+            pattern++;
+            string++;
+        }
+        else
+        if (star && *star_at != '/') {
+            pattern = star;
+            string = ++star_at;
+        }
+        else
+        if (any && !dirs) {
+            star = NULL;
+            pattern = any;
+            string = ++any_at;
+        }
+        else
+        if (any && strchr (any_at, '/')) {
+            star = NULL;
+            pattern = any;
+            string = any_at = strchr (any_at, '/') + 1;
+        }
+        else
+            return false;
+    }
+    //  What's left of the pattern has to match nothing
+    while (*pattern == '*') {
+        if (pattern [1] == '*' && pattern [2] == '/'
+        && (pattern == start || pattern [-1] == '/'))
+            pattern += 3;
+        else
+            pattern++;
+    }
+    return *pattern == 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return a list of the patterns in an option, one per line, or NULL if
+//  there are none. Patterns are relative to the subscription path.
+//
+
+static zlist_t *
+s_patterns_new (const char *lines)
+{
+    zlist_t *patterns = NULL;
+    while (lines && *lines) {
+        size_t length = strcspn (lines, "\n");
+        char *pattern = (char *) zmalloc (length + 1);
+        memcpy (pattern, lines, length);
+        lines += length + (lines [length] == '\n');
+        char *relative = pattern + strspn (pattern, "/");
+        if (*relative) {
+            if (!patterns) {
+                patterns = zlist_new ();
+                zlist_autofree (patterns);
+            }
+            zlist_append (patterns, relative);
+        }
+        free (pattern);
+    }
+    return patterns;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if a path relative to the subscription matches any of the
+//  patterns. Patterns without a '/' match the file name alone, wherever
+//  the file is.
+//
+
+static bool
+s_patterns_match (zlist_t *patterns, const char *path)
+{
+    const char *name = strrchr (path, '/');
+    name = name? name + 1: path;
+    char *pattern = (char *) zlist_first (patterns);
+    while (pattern) {
+        if (s_glob_match (pattern, strchr (pattern, '/')? path: name))
+            return true;
+        pattern = (char *) zlist_next (patterns);
+    }
+    return false;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Take the client's include and exclude patterns from its subscription
+//  options, each a list of glob patterns, one per line
+//
+
+static void
+sub_set_filters (sub_t *self, zhash_t *options)
+{
+    zlist_destroy (&self->include);
+    zlist_destroy (&self->exclude);
+    if (options) {
+        self->include = s_patterns_new (
+            (char *) zhash_lookup (options, "include"));
+        self->exclude = s_patterns_new (
+            (char *) zhash_lookup (options, "exclude"));
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if the subscriber wants the file at a virtual path: it is
+//  under the subscription path, matches an include pattern if there are
+//  any, and matches no exclude pattern.
+//
+
+static bool
+sub_wants (sub_t *self, const char *vpath)
+{
+    size_t length = strlen (self->path);
+    if (strncmp (vpath, self->path, length) != 0
+    ||  (length && self->path [length - 1] != '/'
+                && vpath [length] && vpath [length] != '/'))
+        return false;
+    if (!self->include && !self->exclude)
+        return true;
+
+    const char *path = vpath + length;
+    path += strspn (path, "/");
+    return (!self->include || s_patterns_match (self->include, path))
+        && !(self->exclude && s_patterns_match (self->exclude, path));
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if a subscription at or above another's path gets everything
+//  the other would: it is for the same client and isn't filtered.
+//
+
+static bool
+sub_covers (sub_t *self, sub_t *other)
+{
+    return self->client == other->client
+        && !self->include && !self->exclude;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Add update to sub client patches list
+//
+
+static void
+sub_update_add (sub_t *self, update_t *update)
+{
+    zdir_patch_t *patch = update->patch;
+    //  Drop patches for files the client didn't subscribe to
+    if (!sub_wants (self, zdir_patch_vpath (patch)))
+        return;
+
+    //  Debug print where we are and information on the incoming patch
+    zsys_debug ("@@ sub_update_add, incoming patch info below");
+    zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
+        zdir_patch_op (patch), zdir_patch_vpath (patch));
+
+    //  Skip file creation if client already has identical file
+    if (zdir_patch_op (patch) == patch_create && update->digest) {
+        char *cached = (char *) zhash_lookup (self->cache,
+                                              zdir_patch_vpath (patch));
+        if (cached && streq (cached, update->digest)) {
+            zsys_debug ("sub_update_add: skipping patch");
+            return;             //  Just skip patch for this client
+        }
+    }
+    //  Remove any previous patch for the same file; the new patch, create
+    //  or delete, supersedes it
+    void *handle = zhash_lookup (self->client->queued, zdir_patch_vpath (patch));
+    if (handle) {
+        update_t *existing = (update_t *) zlistx_detach (
+            self->client->patches, handle);
+        zsys_debug ("!!! removing patch !!!");
+        zsys_debug ("path=%s, op=%d, vpath=%s",
+            zdir_patch_path (existing->patch),
+            zdir_patch_op (existing->patch),
+            zdir_patch_vpath (existing->patch));
+        zhash_delete (self->client->queued, zdir_patch_vpath (patch));
+        zhash_delete (self->client->wanted, zdir_patch_vpath (patch));
+        update_destroy (&existing);
+    }
+    //  Remember what the client will have once we send the patch
+    if (zdir_patch_op (patch) == patch_create && update->digest)
+        zhash_update (self->cache, zdir_patch_vpath (patch), update->digest);
+    else
+        zhash_delete (self->cache, zdir_patch_vpath (patch));
+
+    zsys_debug ("+++ adding following patch to client list +++");
+    zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
+        zdir_patch_op (patch), zdir_patch_vpath (patch));
+
+    //  Track that we've queued patch for client, so we don't do it twice
+    handle = zlistx_add_end (self->client->patches, update_link (update));
+    zhash_insert (self->client->queued, zdir_patch_vpath (patch), handle);
+}
+
+//  --------------------------------------------------------------------------
+//  Index entry, remembers a file's digest for as long as the file does
+//  not change, so we don't have to read the file again.
+//
+
+typedef struct {
+    off_t size;                 //  File size when digested
+    time_t modified;            //  File modification time when digested
+    ino_t inode;                //  File inode when digested
+    char *digest;               //  SHA-1 digest of file contents
+} entry_t;
+
+static entry_t *
+entry_new (off_t size, time_t modified, ino_t inode, const char *digest)
+{
+    entry_t *self = (entry_t *) zmalloc (sizeof (entry_t));
+    self->size = size;
+    self->modified = modified;
+    self->inode = inode;
+    self->digest = strdup (digest);
+    return self;
+}
+
+static void
+entry_destroy (entry_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        entry_t *self = *self_p;
+        free (self->digest);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Callback when we remove an entry from a mount index
+static void
+s_entry_free (void *argument)
+{
+    entry_t *entry = (entry_t *) argument;
+    entry_destroy (&entry);
+}
+
+//  --------------------------------------------------------------------------
+//  Mount point in memory
+//
+
+struct _mount_t {
+    server_t *server;       //  Parent server
+    char *location;         //  Physical location
+    char *alias;            //  Alias into our tree
+    zdir_t *dir;            //  Directory snapshot, once taken
+    zlist_t *subs;          //  Client subscriptions
+    trie_t *routes;         //  Client subscriptions, by path
+    int watch;              //  Change notification descriptor, if any
+    zactor_t *watcher;      //  Tells us when there are notifications
+    zhash_t *watches;       //  Watched directories, by descriptor
+    zhash_t *emitted;       //  Patches sent since last full scan
+    int64_t rescan_at;      //  Time of next full scan
+    bool rescan;            //  Changes were lost, scan on next tick
+    zlist_t *pending;       //  Updates waiting for their digest
+    zhash_t *index;         //  File digests, by filename in mount
+    char *index_file;       //  Where we keep the index, if anywhere
+    bool index_dirty;       //  Index has changed since we saved it
+    zhash_t *tree;          //  Entries of each directory, once asked for
+    zhash_t *summaries;     //  Digests of directories, as worked out
+};
+
+static void
+    server_hash (server_t *self, update_t *update);
+#if defined (__UTYPE_LINUX)
+static void
+    mount_watch_tree (mount_t *self, const char *path, zlist_t *patches);
+static void
+    s_watcher (zsock_t *pipe, void *args);
+static int
+    s_server_handle_watch (zloop_t *loop, zsock_t *reader, void *argument);
+#endif
+
+//  --------------------------------------------------------------------------
+//  Return our snapshot of the mount, taking it if we haven't yet. When the
+//  kernel tells us about changes we don't need one until a client does.
+//
+
+static zdir_t *
+mount_snapshot (mount_t *self)
+{
+    if (!self->dir)
+        self->dir = zdir_new (self->location, NULL);
+    return self->dir;
+}
+
+//  --------------------------------------------------------------------------
+//  Load the mount index from disk, if we have one. We don't check the
+//  entries here; they are checked when we need them.
+//
+
+static void
+mount_index_load (mount_t *self)
+{
+    FILE *handle = self->index_file? fopen (self->index_file, "r"): NULL;
+    if (!handle)
+        return;
+
+    char line [PATH_MAX + 128];
+    while (fgets (line, sizeof (line), handle)) {
+        unsigned long inode;
+        long size, modified;
+        char digest [41];
+        int offset = 0;
+        if (sscanf (line, "%lu %ld %ld %40s%n",
+                    &inode, &size, &modified, digest, &offset) < 4
+        ||  line [offset] != ' ')
+            continue;           //  Skip anything we don't understand
+        char *filename = line + offset + 1;
+        filename [strcspn (filename, "\n")] = 0;
+        entry_t *entry = entry_new ((off_t) size, (time_t) modified,
+                                    (ino_t) inode, digest);
+        zhash_update (self->index, filename, entry);
+        zhash_freefn (self->index, filename, s_entry_free);
+    }
+    fclose (handle);
+    zsys_info ("mount_index_load: %d entries for %s",
+        (int) zhash_size (self->index), self->location);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Save the mount index to disk, if it changed. Only files that are in
+//  the current snapshot are saved, which drops files deleted while we
+//  weren't looking.
+//
+
+static void
+mount_index_save (mount_t *self)
+{
+    if (!self->index_file || !self->index_dirty)
+        return;
+
+    char *tmpname = zsys_sprintf ("%s.tmp", self->index_file);
+    FILE *handle = fopen (tmpname, "w");
+    if (!handle) {
+        zsys_warning ("mount_index_save: cannot write %s", tmpname);
+        free (tmpname);
+        return;
+    }
+    zfile_t **files = zdir_flatten (mount_snapshot (self));
+    uint index;
+    for (index = 0; files [index]; index++) {
+        const char *filename = zfile_filename (files [index], self->location);
+        entry_t *entry = (entry_t *) zhash_lookup (self->index, filename);
+        if (entry && !strchr (filename, '\n'))
+            fprintf (handle, "%lu %ld %ld %s %s\n",
+                (unsigned long) entry->inode, (long) entry->size,
+                (long) entry->modified, entry->digest, filename);
+    }
+    zdir_flatten_free (&files);
+    if (fclose (handle) == 0 && rename (tmpname, self->index_file) == 0)
+        self->index_dirty = false;
+    else
+        zsys_warning ("mount_index_save: cannot save %s", self->index_file);
+    free (tmpname);
+}
+
+
+//  --------------------------------------------------------------------------
+//  The mount tree holds the entries of each directory in the mount, by
+//  directory relative to the mount, "" being the mount itself. Entries are
+//  "D" for a directory, or "F" then the digest for a file. We build it the
+//  first time a client asks what directories hold, and keep it up to date
+//  as files change. Directory summaries are worked out when asked for, and
+//  dropped when anything under the directory changes.
+//
+
+static void
+s_children_free (void *argument)
+{
+    zhash_t *children = (zhash_t *) argument;
+    zhash_destroy (&children);
+}
+
+static int
+s_compare_names (const void *item1, const void *item2)
+{
+    return strcmp ((const char *) item1, (const char *) item2);
+}
+
+//  Join a directory and a name within it; caller frees the result
+
+static char *
+s_tree_join (const char *directory, const char *name)
+{
+    return *directory? zsys_sprintf ("%s/%s", directory, name): strdup (name);
+}
+
+//  Return the entries of a directory, creating it and the directories
+//  above it as needed
+
+static zhash_t *
+s_tree_directory (zhash_t *tree, const char *directory)
+{
+    zhash_t *children = (zhash_t *) zhash_lookup (tree, directory);
+    if (!children) {
+        children = zhash_new ();
+        zhash_autofree (children);
+        zhash_insert (tree, directory, children);
+        zhash_freefn (tree, directory, s_children_free);
+        if (*directory) {
+            char *parent = strdup (directory);
+            char *slash = strrchr (parent, '/');
+            *(slash? slash: parent) = 0;
+            zhash_update (s_tree_directory (tree, parent),
+                          slash? slash + 1: directory, "D");
+            free (parent);
+        }
+    }
+    return children;
+}
+
+//  Return the summary of a directory, working it out if needed
+
+static const char *
+s_tree_summary (zhash_t *tree, zhash_t *summaries, const char *directory)
+{
+    char *summary = (char *) zhash_lookup (summaries, directory);
+    if (summary)
+        return summary;
+
+    zdigest_t *digest = zdigest_new ();
+    zhash_t *children = (zhash_t *) zhash_lookup (tree, directory);
+    zlist_t *names = children? zhash_keys (children): NULL;
+    if (names)
+        zlist_sort (names, s_compare_names);
+    char *name = names? (char *) zlist_first (names): NULL;
+    while (name) {
+        const char *value = (const char *) zhash_lookup (children, name);
+        char *line;
+        if (*value == 'D') {
+            char *path = s_tree_join (directory, name);
+            line = zsys_sprintf ("D %s %s\n",
+                s_tree_summary (tree, summaries, path), name);
+            free (path);
+        }
+        else
+            line = zsys_sprintf ("F %s %s\n", value + 1, name);
+        zdigest_update (digest, (byte *) line, strlen (line));
+        free (line);
+        name = (char *) zlist_next (names);
+    }
+    zlist_destroy (&names);
+    zhash_update (summaries, directory, (char *) zdigest_string (digest));
+    zdigest_destroy (&digest);
+    return (const char *) zhash_lookup (summaries, directory);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Record a file in the mount tree with its digest, or UNKNOWN_DIGEST if
+//  we don't have it yet, or remove it if digest is NULL. Directories left
+//  empty are removed too.
+//
+
+static void
+mount_tree_update (mount_t *self, const char *filename, const char *digest)
+{
+    if (!self->tree || strchr (filename, '\n'))
+        return;
+    char *directory = strdup (filename);
+    char *slash = strrchr (directory, '/');
+    *(slash? slash: directory) = 0;
+    const char *name = slash? filename + (slash - directory) + 1: filename;
+
+    zhash_t *children = (zhash_t *) zhash_lookup (self->tree, directory);
+    const char *known = children?
+        (const char *) zhash_lookup (children, name): NULL;
+    if (digest? known && *known == 'F' && streq (known + 1, digest): !known) {
+        free (directory);
+        return;                 //  No change
+    }
+    //  Directories above the file need working out again
+    char *parent = strdup (directory);
+    while (true) {
+        zhash_delete (self->summaries, parent);
+        if (!*parent)
+            break;
+        slash = strrchr (parent, '/');
+        *(slash? slash: parent) = 0;
+    }
+    free (parent);
+
+    if (digest) {
+        char *value = zsys_sprintf ("F%s", digest);
+        zhash_update (s_tree_directory (self->tree, directory), name, value);
+        free (value);
+    }
+    else {
+        zhash_delete (children, name);
+        while (*directory && zhash_size (children) == 0) {
+            zhash_delete (self->tree, directory);
+            slash = strrchr (directory, '/');
+            if (slash)
+                *slash = 0;
+            children = (zhash_t *) zhash_lookup (self->tree,
+                                                 slash? directory: "");
+            zhash_delete (children, slash? slash + 1: directory);
+            if (!slash)
+                *directory = 0;
+        }
+    }
+    free (directory);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Build the mount tree from our snapshot, with the digests we have in the
+//  index. Files we haven't digested yet go in as UNKNOWN_DIGEST.
+//
+
+static void
+mount_tree_build (mount_t *self)
+{
+    if (self->tree)
+        return;
+    self->tree = zhash_new ();
+    self->summaries = zhash_new ();
+    zhash_autofree (self->summaries);
+    s_tree_directory (self->tree, "");
+
+    zfile_t **files = zdir_flatten (mount_snapshot (self));
+    uint index;
+    for (index = 0; files [index]; index++) {
+        zfile_t *file = files [index];
+        const char *filename = zfile_filename (file, self->location);
+        entry_t *entry = (entry_t *) zhash_lookup (self->index, filename);
+        if (entry
+        &&  entry->size == zfile_cursize (file)
+        &&  entry->modified == zfile_modified (file))
+            mount_tree_update (self, filename, entry->digest);
+        else
+            mount_tree_update (self, filename, UNKNOWN_DIGEST);
+    }
+    zdir_flatten_free (&files);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if a path relative to a mount stays inside it: it has no
+//  "." or ".." components, and no empty ones but a trailing one. Clients
+//  name paths, so we check them before we open anything.
+//
+
+static bool
+s_path_safe (const char *path)
+{
+    while (*path) {
+        size_t length = strcspn (path, "/");
+        if ((length == 0 && path [1])
+        ||  (length == 1 && path [0] == '.')
+        ||  (length == 2 && path [0] == '.' && path [1] == '.'))
+            return false;
+        path += length + (path [length] == '/');
+    }
+    return true;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the path in the mount of a virtual path, or NULL if the virtual
+//  path isn't in this mount, or would lead out of it
+//
+
+static const char *
+mount_tree_path (mount_t *self, const char *vpath)
+{
+    size_t length = strlen (self->alias);
+    if (strncmp (vpath, self->alias, length))
+        return NULL;
+    vpath += length;
+    if (*vpath && length && self->alias [length - 1] != '/') {
+        if (*vpath != '/')
+            return NULL;        //  Alias is only part of a name
+        vpath++;
+    }
+    return s_path_safe (vpath)? vpath: NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Add the entries of a directory to a summary, for a YARLY: a 4-octet
+//  count, then for each entry a 1-octet type, a 2-octet size and name, and
+//  its 20-octet SHA-1. A directory we don't have has a count of all ones.
+//
+
+static void
+mount_tree_summarize (mount_t *self, const char *directory, zchunk_t *summary)
+{
+    zhash_t *children = self && directory?
+        (zhash_t *) zhash_lookup (self->tree, directory): NULL;
+    uint32_t count = children? (uint32_t) zhash_size (children): 0xFFFFFFFF;
+    byte header [4] = {
+        (byte) (count >> 24), (byte) (count >> 16),
+        (byte) (count >> 8), (byte) count
+    };
+    zchunk_extend (summary, header, 4);
+
+    const char *value = children? (const char *) zhash_first (children): NULL;
+    while (value) {
+        const char *name = zhash_cursor (children);
+        const char *hex = value + 1;
+        if (*value == 'D') {
+            char *path = s_tree_join (directory, name);
+            hex = s_tree_summary (self->tree, self->summaries, path);
+            free (path);
+        }
+        size_t size = strlen (name);
+        byte entry [3 + 20] = {
+            (byte) (*value == 'D'? 2: 1), (byte) (size >> 8), (byte) size
+        };
+        int index;
+        for (index = 0; index < 20; index++) {
+            unsigned int octet;
+            sscanf (hex + index * 2, "%2x", &octet);
+            entry [3 + index] = (byte) octet;
+        }
+        zchunk_extend (summary, entry, 3);
+        zchunk_extend (summary, name, size);
+        zchunk_extend (summary, entry + 3, 20);
+        value = (const char *) zhash_next (children);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Look for the digest of a create patch in the index, and use it if the
+//  file did not change since we last read it. Returns true if the update
+//  needs no further work, false if the file must be read.
+//
+
+static bool
+mount_index_lookup (mount_t *self, update_t *update)
+{
+    zfile_t *file = zdir_patch_file (update->patch);
+    const char *filename = zfile_filename (file, self->location);
+    if (zdir_patch_op (update->patch) == patch_delete) {
+        zhash_delete (self->index, filename);
+        self->index_dirty = true;
+        mount_tree_update (self, filename, NULL);
+        return true;
+    }
+    struct stat stat_buf;
+    if (stat (zfile_filename (file, NULL), &stat_buf)) {
+        mount_tree_update (self, filename, NULL);
+        return true;            //  File is gone, nothing to digest
+    }
+    entry_t *entry = (entry_t *) zhash_lookup (self->index, filename);
+    if (entry
+    &&  entry->size == stat_buf.st_size
+    &&  entry->modified == stat_buf.st_mtime
+    &&  entry->inode == stat_buf.st_ino) {
+        update->digest = strdup (entry->digest);
+        mount_tree_update (self, filename, update->digest);
+        return true;
+    }
+    mount_tree_update (self, filename, UNKNOWN_DIGEST);
+    return false;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Store the digest a worker computed for a file, along with the file
+//  properties it saw before it started reading.
+//
+
+static void
+mount_index_store (mount_t *self, update_t *update,
+                   off_t size, time_t modified, ino_t inode)
+{
+    zfile_t *file = zdir_patch_file (update->patch);
+    const char *filename = zfile_filename (file, self->location);
+    entry_t *entry = entry_new (size, modified, inode, update->digest);
+    zhash_update (self->index, filename, entry);
+    zhash_freefn (self->index, filename, s_entry_free);
+    self->index_dirty = true;
+    mount_tree_update (self, filename, update->digest);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Stop watching for changes, so mount falls back to full scans
+//
+
+static void
+mount_unwatch (mount_t *self)
+{
+    if (self->watcher) {
+        engine_handle_socket (self->server, self->watcher, NULL);
+        zactor_destroy (&self->watcher);
+    }
+    if (self->watch != -1) {
+        close (self->watch);
+        self->watch = -1;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Constructor for the mount class
+//  Loads directory tree if possible
+//
+
+static mount_t *
+mount_new (server_t *server, char *location, char *alias)
+{
+    //  Mount path must start with '/'
+    //  We'll do better error handling later
+    assert (*alias == '/');
+
+    mount_t *self = (mount_t *) zmalloc (sizeof (mount_t));
+    self->server = server;
+    self->location = strdup (location);
+    self->alias = strdup (alias);
+    self->subs = zlist_new ();
+    self->routes = trie_new (NULL, "");
+    self->pending = zlist_new ();
+    self->watches = zhash_new ();
+    zhash_autofree (self->watches);
+    self->emitted = zhash_new ();
+    zhash_autofree (self->emitted);
+    self->watch = -1;
+
+    //  If we're configured to keep indexes, load any we saved before
+    self->index = zhash_new ();
+    char *index_path = zconfig_resolve (server->config,
+        "fmq_server/index_path", NULL);
+    if (index_path) {
+        zdigest_t *digest = zdigest_new ();
+        zdigest_update (digest, (byte *) location, strlen (location));
+        self->index_file = zsys_sprintf ("%s/%s.idx",
+            index_path, zdigest_string (digest));
+        zdigest_destroy (&digest);
+        mount_index_load (self);
+    }
+
+#if defined (__UTYPE_LINUX)
+    //  Ask the kernel to tell us about changes, so we only rescan the
+    //  whole tree now and then. Without this we rescan on every tick.
+    self->watch = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (self->watch == -1)
+        zsys_warning ("mount_new: cannot watch %s, will rescan", location);
+    else
+        mount_watch_tree (self, self->location, NULL);
+    if (self->watch != -1) {
+        //  The engine only polls sockets, so a watcher polls the descriptor
+        //  for us. Watching the tree walked it, so put off the first scan.
+        self->watcher = zactor_new (s_watcher, &self->watch);
+        assert (self->watcher);
+        engine_handle_socket (server, self->watcher, s_server_handle_watch);
+        char *value = zconfig_resolve (server->config,
+            "fmq_server/rescan_interval", NULL);
+        self->rescan_at = zclock_mono ()
+                        + (value? atoi (value): RESCAN_INTERVAL);
+    }
+#endif
+    //  Without notifications we diff against a snapshot on every tick
+    if (self->watch == -1)
+        mount_snapshot (self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destructor for the mount class
+//
+
+static void
+mount_destroy (mount_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mount_t *self = *self_p;
+        mount_unwatch (self);
+        mount_index_save (self);
+        zhash_destroy (&self->index);
+        free (self->index_file);
+        zhash_destroy (&self->tree);
+        zhash_destroy (&self->summaries);
+        zhash_destroy (&self->watches);
+        zhash_destroy (&self->emitted);
+        free (self->location);
+        free (self->alias);
+        //  Destroy subscriptions
+        trie_destroy (&self->routes);
+        while (zlist_size (self->subs)) {
+            sub_t *sub = (sub_t *) zlist_pop (self->subs);
+            sub_destroy (&sub);
+        }
+        zlist_destroy (&self->subs);
+        while (zlist_size (self->pending)) {
+            update_t *update = (update_t *) zlist_pop (self->pending);
+            update_destroy (&update);
+        }
+        zlist_destroy (&self->pending);
+        zdir_destroy (&self->dir);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Pass updates that are ready to all subscribers. Updates go out in the
+//  order we found them, so a file waiting for its digest holds back any
+//  later changes. Returns true if any updates were queued for a client.
+//
+
+static bool
+mount_flush (mount_t *self)
+{
+    bool activity = false;
+    update_t *update = (update_t *) zlist_first (self->pending);
+    while (update && !update->hashing) {
+        zlist_pop (self->pending);
+        if (update->sub) {
+            sub_update_add (update->sub, update);
+            activity = true;
+        }
+        else
+        if (!update->orphan) {
+            //  Only subscribers to the path or above it want the update.
+            //  A client with several subscriptions gets it once, from the
+            //  first one that wants it, so it has the union of its filters.
+            const char *vpath = zdir_patch_vpath (update->patch);
+            zlist_t *subs = zlist_new ();
+            zlist_t *clients = zlist_new ();
+            trie_match (self->routes, vpath, subs);
+            sub_t *sub = (sub_t *) zlist_first (subs);
+            while (sub) {
+                if (!zlist_exists (clients, sub->client)
+                &&  sub_wants (sub, vpath)) {
+                    zlist_append (clients, sub->client);
+                    sub_update_add (sub, update);
+                    activity = true;
+                }
+                sub = (sub_t *) zlist_next (subs);
+            }
+            zlist_destroy (&clients);
+            zlist_destroy (&subs);
+        }
+        update_destroy (&update);
+        update = (update_t *) zlist_first (self->pending);
+    }
+    return activity;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Turn a list of patches into updates for all subscribers, then destroy
+//  the list. Files we don't have a digest for are passed to the hashing
+//  workers. Returns true if any updates were queued for a client.
+//
+
+static bool
+mount_dispatch (mount_t *self, zlist_t **patches_p)
+{
+    zlist_t *patches = *patches_p;
+    while (zlist_size (patches)) {
+        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
+        update_t *update = update_new (self, &patch);
+        if (!mount_index_lookup (self, update)) {
+            update->hashing = true;
+            server_hash (self->server, update);
+        }
+        zlist_append (self->pending, update);
+    }
+    zlist_destroy (patches_p);
+    return mount_flush (self);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Queue a patch for one subscriber only, taking ownership of the patch.
+//  Call mount_flush to pass it on.
+//
+
+static void
+mount_sub_queue (mount_t *self, sub_t *sub, zdir_patch_t **patch_p)
+{
+    //  Don't digest files the subscriber filters out
+    if (!sub_wants (sub, zdir_patch_vpath (*patch_p))) {
+        zdir_patch_destroy (patch_p);
+        return;
+    }
+    update_t *update = update_new (self, patch_p);
+    update->sub = sub;
+    if (!mount_index_lookup (self, update)) {
+        update->hashing = true;
+        server_hash (self->server, update);
+    }
+    zlist_append (self->pending, update);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Queue a file, or everything under a directory, for one subscriber only,
+//  by path in the mount. Returns false if the mount tree has no such file
+//  or directory. Call mount_flush to pass the updates on.
+//
+
+static bool
+mount_sub_queue_tree (mount_t *self, sub_t *sub, const char *path)
+{
+    if (!s_path_safe (path))
+        return false;
+    zhash_t *children = (zhash_t *) zhash_lookup (self->tree, path);
+    if (children) {
+        zlist_t *names = zhash_keys (children);
+        char *name = (char *) zlist_first (names);
+        while (name) {
+            char *child = s_tree_join (path, name);
+            mount_sub_queue_tree (self, sub, child);
+            free (child);
+            name = (char *) zlist_next (names);
+        }
+        zlist_destroy (&names);
+        return true;
+    }
+    char *fullname = zsys_sprintf ("%s/%s", self->location, path);
+    zfile_t *file = zfile_new (NULL, fullname);
+    bool found = *path && zfile_is_regular (file);
+    if (found) {
+        zdir_patch_t *patch = zdir_patch_new (
+            self->location, file, patch_create, self->alias);
+        mount_sub_queue (self, sub, &patch);
+    }
+    zfile_destroy (&file);
+    free (fullname);
+    return found;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return a new update for a file in the mount, by virtual path, or NULL if
+//  there is no such file or the client doesn't subscribe to it. This is for
+//  a client asking for a file again, as it couldn't use what we sent.
+//
+
+static update_t *
+mount_file_update (mount_t *self, client_t *client, const char *vpath)
+{
+    const char *path = mount_tree_path (self, vpath);
+    if (!path || !*path)
+        return NULL;
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub && !(sub->client == client && sub_wants (sub, vpath)))
+        sub = (sub_t *) zlist_next (self->subs);
+    if (!sub)
+        return NULL;
+
+    zfile_t *file = zfile_new (self->location, path);
+    if (!zfile_is_regular (file)) {
+        zfile_destroy (&file);
+        return NULL;
+    }
+    zdir_patch_t *patch = zdir_patch_new (self->location, file, patch_create,
+                                          self->alias);
+    zfile_destroy (&file);
+    update_t *update = update_new (self, &patch);
+    mount_index_lookup (self, update);
+    return update;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Forget a subscriber in any updates still waiting to be sent to it
+//
+
+static void
+mount_sub_forget (mount_t *self, sub_t *sub)
+{
+    update_t *update = (update_t *) zlist_first (self->pending);
+    while (update) {
+        if (update->sub == sub) {
+            update->sub = NULL;
+            update->orphan = true;
+        }
+        update = (update_t *) zlist_next (self->pending);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return a key that tells whether a full scan found the same change we
+//  already sent from a change notification. Caller frees the key.
+//
+
+static char *
+s_patch_key (zdir_patch_t *patch)
+{
+    if (zdir_patch_op (patch) == patch_delete)
+        return strdup ("delete");
+
+    zfile_t *file = zdir_patch_file (patch);
+    return zsys_sprintf ("create:%ld:%ld",
+        (long) zfile_modified (file), (long) zfile_cursize (file));
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reloads directory tree and returns true if activity, false if the same
+//
+
+static bool
+mount_refresh (mount_t *self, server_t *server)
+{
+    zsys_debug ("mount_refresh: checking for changes to mount point");
+
+    //  Get latest snapshot and build a patches list for any changes
+    //  Load the server local path, no parent dir.
+    zdir_t *latest = zdir_new (self->location, NULL);
+
+    //  With no snapshot yet, no client has subscribed, so there is nobody
+    //  to tell about changes; the latest snapshot is our first.
+    if (!self->dir) {
+        self->dir = latest;
+        zhash_purge (self->emitted);
+        self->rescan = false;
+        return false;
+    }
+    //  Get list of patches using old and new dir with location as seen by
+    //  the client.
+    zlist_t *patches = zdir_diff (self->dir, latest, self->alias);
+
+    //  Go through the patches just received and drop any that we already
+    //  sent when the kernel told us about them. If the kernel lost events,
+    //  we can't trust that and send everything.
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        zsys_debug ("--- patch=%s, vpath=%s, op=%d", zdir_patch_path (patch),
+            zdir_patch_vpath (patch), zdir_patch_op (patch));
+        zdir_patch_t *next = (zdir_patch_t *) zlist_next (patches);
+        const char *sent = (const char *) zhash_lookup (
+            self->emitted, zdir_patch_vpath (patch));
+        if (sent && !self->rescan) {
+            char *key = s_patch_key (patch);
+            if (streq (key, sent)) {
+                zlist_remove (patches, patch);
+                zdir_patch_destroy (&patch);
+            }
+            free (key);
+        }
+        patch = next;
+    }
+    zhash_destroy (&self->emitted);
+    self->emitted = zhash_new ();
+    zhash_autofree (self->emitted);
+    self->rescan = false;
+
+    //  Drop old directory and replace with latest version
+    zdir_destroy (&self->dir);
+    self->dir = latest;
+
+    bool activity = mount_dispatch (self, &patches);
+    mount_index_save (self);
+    return activity;
+}
+
+
+#if defined (__UTYPE_LINUX)
+//  --------------------------------------------------------------------------
+//  Add a patch for a single file we heard about from the kernel, and
+//  remember it so the next full scan doesn't send it again.
+//
+
+static void
+mount_watch_patch (mount_t *self, zlist_t *patches,
+                   const char *path, const char *name, int op)
+{
+    zfile_t *file = zfile_new (path, name);
+    if (op == patch_create && !zfile_is_regular (file)) {
+        zfile_destroy (&file);
+        return;                 //  Not something we publish
+    }
+    zdir_patch_t *patch = zdir_patch_new (self->location, file, op, self->alias);
+    zfile_destroy (&file);
+    char *key = s_patch_key (patch);
+    zhash_update (self->emitted, zdir_patch_vpath (patch), key);
+    free (key);
+    zlist_append (patches, patch);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Watch a directory and everything below it. If patches is not null,
+//  also add create patches for any files we find, since they may have
+//  arrived before the watch did.
+//
+
+static void
+mount_watch_tree (mount_t *self, const char *path, zlist_t *patches)
+{
+    int wd = inotify_add_watch (self->watch, path, WATCH_EVENTS);
+    if (wd == -1 && (errno == ENOENT || errno == ENOTDIR))
+        return;                 //  Gone already, nothing to watch
+    if (wd == -1) {
+        //  Typically we ran out of watches; fall back to scanning
+        zsys_warning ("mount_watch_tree: cannot watch %s (%s), will rescan",
+            path, strerror (errno));
+        mount_unwatch (self);
+        self->rescan = true;
+        return;
+    }
+    char key [16];
+    snprintf (key, sizeof (key), "%d", wd);
+    zhash_update (self->watches, key, (void *) path);
+
+    DIR *handle = opendir (path);
+    if (!handle)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir (handle)) && self->watch != -1) {
+        //  Skip hidden files, and . and ..
+        if (*entry->d_name == '.')
+            continue;
+        char *fullname = zsys_sprintf ("%s/%s", path, entry->d_name);
+        struct stat stat_buf;
+        if (lstat (fullname, &stat_buf) == 0) {
+            if (S_ISDIR (stat_buf.st_mode))
+                mount_watch_tree (self, fullname, patches);
+            else
+            if (patches && S_ISREG (stat_buf.st_mode))
+                mount_watch_patch (self, patches, path, entry->d_name,
+                                   patch_create);
+        }
+        free (fullname);
+    }
+    closedir (handle);
+}
+
+
+//  --------------------------------------------------------------------------
+//  A watched directory was deleted or moved. If it moved inside the mount
+//  we already followed it; otherwise we drop its watch and those below it,
+//  which would now report on paths that aren't there, and walk its parent
+//  again to watch whatever is there now.
+//
+
+static void
+mount_watch_lost (mount_t *self, int wd)
+{
+    char key [16];
+    snprintf (key, sizeof (key), "%d", wd);
+    const char *found = (const char *) zhash_lookup (self->watches, key);
+    if (!found)
+        return;
+    char *path = strdup (found);
+    int current = inotify_add_watch (self->watch, path, WATCH_EVENTS);
+    if (current == wd) {
+        free (path);
+        return;                 //  Still there under the same name
+    }
+    size_t length = strlen (path);
+    zlist_t *keys = zhash_keys (self->watches);
+    char *name = (char *) zlist_first (keys);
+    while (name) {
+        const char *watched = (const char *) zhash_lookup (self->watches, name);
+        if (strncmp (watched, path, length) == 0
+        && (watched [length] == 0 || watched [length] == '/')) {
+            if (atoi (name) != current)
+                inotify_rm_watch (self->watch, atoi (name));
+            zhash_delete (self->watches, name);
+        }
+        name = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+
+    if (streq (path, self->location)) {
+        //  The mount itself went; all we can do is scan for it
+        mount_unwatch (self);
+        self->rescan = true;
+    }
+    else {
+        *strrchr (path, '/') = 0;
+        mount_watch_tree (self, path, NULL);
+    }
+    free (path);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Turn change notifications into patches for just the files that were
+//  touched, and dispatch them. Returns true if any updates were queued for
+//  a client.
+//
+
+static bool
+mount_watch_read (mount_t *self)
+{
+    zlist_t *patches = zlist_new ();
+    char buffer [4096]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+    while (self->watch != -1) {
+        ssize_t size = read (self->watch, buffer, sizeof (buffer));
+        if (size <= 0)
+            break;              //  Nothing more to read for now
+        char *needle = buffer;
+        while (needle < buffer + size) {
+            struct inotify_event *event = (struct inotify_event *) needle;
+            needle += sizeof (struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                self->rescan = true;
+                continue;
+            }
+            char key [16];
+            snprintf (key, sizeof (key), "%d", event->wd);
+            const char *path = (const char *) zhash_lookup (self->watches, key);
+            if (!path)
+                continue;
+            if (event->mask & IN_IGNORED) {
+                zhash_delete (self->watches, key);
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                mount_watch_lost (self, event->wd);
+                continue;
+            }
+            if (event->len == 0 || *event->name == '.')
+                continue;
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    char *fullname = zsys_sprintf ("%s/%s", path, event->name);
+                    mount_watch_tree (self, fullname, patches);
+                    free (fullname);
+                }
+                else
+                if (event->mask & IN_MOVED_FROM)
+                    //  We don't know what the directory held, so rescan
+                    self->rescan = true;
+            }
+            else
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                mount_watch_patch (self, patches, path, event->name,
+                                   patch_create);
+            else
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                mount_watch_patch (self, patches, path, event->name,
+                                   patch_delete);
+        }
+    }
+    return mount_dispatch (self, &patches);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Watcher for a mount's change notifications. It says CHANGED when there
+//  are some to read, then waits for NEXT, once we have read them.
+
+static void
+s_watcher (zsock_t *pipe, void *args)
+{
+    int watch = *(int *) args;
+    bool armed = true;
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+        zmq_pollitem_t items [] = {
+            { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+            { NULL, watch, ZMQ_POLLIN, 0 }
+        };
+        if (zmq_poll (items, armed? 2: 1, -1) == -1)
+            break;              //  Interrupted
+        if (items [0].revents & ZMQ_POLLIN) {
+            char *command = zstr_recv (pipe);
+            if (!command || streq (command, "$TERM")) {
+                zstr_free (&command);
+                break;
+            }
+            armed = streq (command, "NEXT");
+            zstr_free (&command);
+        }
+        else
+        if (items [1].revents & ZMQ_POLLIN) {
+            zstr_send (pipe, "CHANGED");
+            armed = false;
+        }
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Handle change notifications for a mount from the server reactor
+
+static int
+s_server_handle_watch (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    server_t *server = (server_t *) argument;
+    char *command = zstr_recv (reader);
+    if (!command)
+        return -1;              //  Interrupted
+    zstr_free (&command);
+
+    mount_t *self = (mount_t *) zlist_first (server->mounts);
+    while (self && !(self->watcher && zactor_sock (self->watcher) == reader))
+        self = (mount_t *) zlist_next (server->mounts);
+    if (!self)
+        return 0;
+    if (mount_watch_read (self))
+        engine_broadcast_event (server, NULL, dispatch_event);
+    if (self->watcher)
+        zstr_send (self->watcher, "NEXT");
+    return 0;
+}
+#endif
+
+
+//  --------------------------------------------------------------------------
+//  Bring our snapshot up to date before we answer a client from it. We take
+//  in any change notifications waiting for us, then rescan if there were
+//  changes since the last full scan, as the snapshot doesn't have them yet;
+//  without notifications, we always rescan. Other clients get any changes.
+//
+
+static void
+mount_catch_up (mount_t *self, client_t *client)
+{
+    bool activity = false;
+#if defined (__UTYPE_LINUX)
+    if (self->watch != -1 && mount_watch_read (self))
+        activity = true;
+#endif
+    if ((self->watch == -1 || zhash_size (self->emitted) || self->rescan)
+    &&  mount_refresh (self, self->server))
+        activity = true;
+    if (activity)
+        engine_broadcast_event (self->server, client, dispatch_event);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Store subscription for mount point
+//
+
+static void
+mount_sub_store (mount_t *self, client_t *client, fmq_msg_t *request)
+{
+    assert (self);
+    assert (self->subs);
+
+    //  Store subscription along with any previous ones
+    //  Coalesce subscriptions that are on same path
+    const char *path = fmq_msg_path (request);
+    zhash_t *options = fmq_msg_options (request);
+    mount_snapshot (self);      //  Baseline for changes we send it
+    zmsg_t *digests = fmq_msg_get_digests (request);
+    sub_t *sub = sub_new (client, path, fmq_msg_cache (request), digests);
+    zmsg_destroy (&digests);
+    sub_set_filters (sub, options);
+
+    //  If client asked for a resync, send it the mount contents under its
+    //  path, except files it told us it has; or else send it any files it
+    //  has part of, so it can finish them. We send those from our snapshot,
+    //  so bring that up to date first.
+    char *value = options? (char *) zhash_lookup (options, "resync"): NULL;
+    bool resync = value && atoi (value) == 1;
+    if (resync || zhash_size (client->resume))
+        mount_catch_up (self, client);
+
+    zlist_t *subs = zlist_new ();
+    trie_match (self->routes, path, subs);
+    sub_t *old = (sub_t *) zlist_first (subs);
+    while (old) {
+        //  If old subscription is superset/same as new, ignore new
+        if (sub_covers (old, sub)) {
+            zsys_debug ("new subscription already exists");
+            zlist_destroy (&subs);
+            sub_destroy (&sub);
+            return;
+        }
+        old = (sub_t *) zlist_next (subs);
+    }
+    //  If new subscription is superset of old ones, remove old
+    zlist_purge (subs);
+    trie_within (self->routes, path, subs);
+    old = (sub_t *) zlist_first (subs);
+    while (old) {
+        if (sub_covers (sub, old)) {
+            zsys_debug ("superset, sub->path=%s, path=%s", old->path, path);
+            mount_sub_forget (self, old);
+            trie_remove (self->routes, old->path, old);
+            zlist_remove (self->subs, old);
+            sub_destroy (&old);
+        }
+        old = (sub_t *) zlist_next (subs);
+    }
+    zlist_destroy (&subs);
+
+    //  New subscription for this client, append to our list
+    zlist_append (self->subs, sub);
+    trie_insert (self->routes, sub->path, sub);
+
+    //  If it compared its summaries with ours, it tells us which files and
+    //  directories differ, one per line, and we send only those
+    char *subtrees = resync?
+        (char *) zhash_lookup (options, "subtrees"): NULL;
+    if (subtrees) {
+        mount_tree_build (self);
+        while (*subtrees) {
+            size_t length = strcspn (subtrees, "\n");
+            char *name = (char *) zmalloc (length + 1);
+            memcpy (name, subtrees, length);
+            subtrees += length + (subtrees [length] == '\n');
+            char *vpath = s_vpath_join (path, name);
+            const char *tree_path = mount_tree_path (self, vpath);
+            bool found = tree_path
+                      && mount_sub_queue_tree (self, sub, tree_path);
+            if (!found && !*name)
+                subtrees = NULL;    //  Path isn't a directory, send it all
+            free (vpath);
+            free (name);
+            if (!subtrees)
+                break;
+        }
+        char *progress = (char *) zhash_first (client->resume);
+        while (subtrees && progress) {
+            const char *tree_path = mount_tree_path (self,
+                zhash_cursor (client->resume));
+            if (tree_path)
+                mount_sub_queue_tree (self, sub, tree_path);
+            progress = (char *) zhash_next (client->resume);
+        }
+    }
+    if (!subtrees && (resync || zhash_size (client->resume))) {
+        zlist_t *patches = zdir_resync (mount_snapshot (self), self->alias);
+        zdir_patch_t *patch;
+        while ((patch = (zdir_patch_t *) zlist_pop (patches))) {
+            const char *vpath = zdir_patch_vpath (patch);
+            if (strncmp (vpath, path, strlen (path)) == 0
+            && (resync || zhash_lookup (client->resume, vpath)))
+                mount_sub_queue (self, sub, &patch);
+            zdir_patch_destroy (&patch);
+        }
+        zlist_destroy (&patches);
+    }
+    mount_flush (self);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Purge subscriptions for a specified client
+//
+
+static void
+mount_sub_purge (mount_t *self, client_t *client)
+{
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub) {
+        if (sub->client == client) {
+            sub_t *next = (sub_t *) zlist_next (self->subs);
+            mount_sub_forget (self, sub);
+            trie_remove (self->routes, sub->path, sub);
+            zlist_remove (self->subs, sub);
+            sub_destroy (&sub);
+            sub = next;
+        }
+        else
+            sub = (sub_t *) zlist_next (self->subs);
+    }
+}
+
+//  ---------------------------------------------------------------------------
+//  Hashing worker, digests files for the server so that reading large
+//  files does not hold up the server's reactor. The update is passed
+//  back untouched; only the server thread looks inside it.
+//
+
+//  Add a block to the list of blocks of a file: a 4-octet size in network
+//  order, then the block's SHA-1 digest
+
+static void
+s_block_put (zchunk_t *blocks, zdigest_t *digest, size_t size)
+{
+    byte header [4];
+    header [0] = (byte) (size >> 24);
+    header [1] = (byte) (size >> 16);
+    header [2] = (byte) (size >> 8);
+    header [3] = (byte) size;
+    zchunk_extend (blocks, header, 4);
+    zchunk_extend (blocks, zdigest_data (digest), zdigest_size (digest));
+}
+
+static void
+s_hasher (zsock_t *pipe, void *args)
+{
+    //  Gear table for content-defined chunking; any fixed random values
+    //  will do, as only the server cuts blocks
+    uint64_t gear [256];
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    int index;
+    for (index = 0; index < 256; index++) {
+        uint64_t value = (seed += 0x9E3779B97F4A7C15ULL);
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        gear [index] = value ^ (value >> 31);
+    }
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+        char *command, *fullname;
+        void *update;
+        int content;
+        if (zsock_recv (pipe, "spsi", &command, &update, &fullname, &content))
+            break;              //  Interrupted
+        if (streq (command, "$TERM")) {
+            zstr_free (&command);
+            zstr_free (&fullname);
+            break;
+        }
+        //  We stat the file before reading it, so if it changes while we
+        //  read, the server's next check will catch that
+        struct stat stat_buf;
+        memset (&stat_buf, 0, sizeof (stat_buf));
+        char *digest = NULL;
+        zchunk_t *blocks = NULL;
+        zfile_t *file = NULL;
+        if (stat (fullname, &stat_buf) == 0)
+            file = zfile_new (NULL, fullname);
+        if (file && zfile_input (file) == 0) {
+            //  Digest the whole file, and for big files, each block too
+            zdigest_t *whole = zdigest_new ();
+            zdigest_t *block = NULL;
+            if (stat_buf.st_size >= DELTA_MIN) {
+                blocks = zchunk_new (NULL, 0);
+                block = zdigest_new ();
+            }
+            size_t block_size = 0;
+            uint64_t hash = 0;
+            off_t offset = 0;
+            while (true) {
+                zchunk_t *data = zfile_read (file, CDC_MAX, offset);
+                if (!data || zchunk_size (data) == 0) {
+                    zchunk_destroy (&data);
+                    break;
+                }
+                byte *bytes = zchunk_data (data);
+                size_t size = zchunk_size (data);
+                zdigest_update (whole, bytes, size);
+                if (blocks) {
+                    size_t start = 0;
+                    size_t cursor;
+                    for (cursor = 0; cursor < size; cursor++) {
+                        hash = (hash << 1) + gear [bytes [cursor]];
+                        bool cut = content
+                            ? (++block_size >= CDC_MIN && (hash & CDC_MASK) == 0)
+                              || block_size == CDC_MAX
+                            : ++block_size == DELTA_BLOCK;
+                        if (cut) {
+                            zdigest_update (block, bytes + start,
+                                            cursor + 1 - start);
+                            s_block_put (blocks, block, block_size);
+                            zdigest_destroy (&block);
+                            block = zdigest_new ();
+                            start = cursor + 1;
+                            block_size = 0;
+                            hash = 0;
+                        }
+                    }
+                    zdigest_update (block, bytes + start, size - start);
+                }
+                offset += size;
+                zchunk_destroy (&data);
+            }
+            if (block_size)
+                s_block_put (blocks, block, block_size);
+            zdigest_destroy (&block);
+            digest = strdup (zdigest_string (whole));
+            zdigest_destroy (&whole);
+        }
+        zfile_destroy (&file);
+        zsock_send (pipe, "sps888p", "HASHED", update, digest? digest: "",
+            (uint64_t) stat_buf.st_size, (uint64_t) stat_buf.st_mtime,
+            (uint64_t) stat_buf.st_ino, blocks);
+        free (digest);
+        zstr_free (&command);
+        zstr_free (&fullname);
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Handle a digest coming back from a hashing worker
+//
+
+static int
+s_server_handle_hasher (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    server_t *self = (server_t *) argument;
+    char *command, *digest;
+    update_t *update;
+    uint64_t size, modified, inode;
+    zchunk_t *blocks;
+    if (zsock_recv (reader, "sps888p", &command, &update, &digest,
+                    &size, &modified, &inode, &blocks))
+        return -1;              //  Interrupted
+
+    update->hashing = false;
+    if (blocks)
+        update->blocks = shared_new (&blocks);
+    if (*digest) {
+        update->digest = strdup (digest);
+        mount_index_store (update->mount, update,
+            (off_t) size, (time_t) modified, (ino_t) inode);
+    }
+    mount_t *mount = update->mount;
+    zstr_free (&command);
+    zstr_free (&digest);
+
+    //  Worker is free for the next job, if any
+    zlist_append (self->idle_hashers, reader);
+    server_hash (self, NULL);
+
+    if (mount_flush (mount))
+        engine_broadcast_event (self, NULL, dispatch_event);
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Queue an update for hashing, and pass queued updates to any idle
+//  workers. We start the workers when we first need them, so they pick
+//  up fmq_server/hash_workers from any loaded configuration.
+//
+
+static void
+server_hash (server_t *self, update_t *update)
+{
+    if (!self->hashers) {
+        int workers = 4;
+#if defined (__UNIX__)
+        workers = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+        char *value = zconfig_resolve (self->config,
+            "fmq_server/hash_workers", NULL);
+        if (value)
+            workers = atoi (value);
+        if (workers < 1)
+            workers = 1;
+
+        self->hashers = zlist_new ();
+        while (workers--) {
+            zactor_t *hasher = zactor_new (s_hasher, NULL);
+            assert (hasher);
+            zlist_append (self->hashers, hasher);
+            zlist_append (self->idle_hashers, zactor_sock (hasher));
+            engine_handle_socket (self, hasher, s_server_handle_hasher);
+        }
+    }
+    if (update)
+        zlist_append (self->hash_jobs, update);
+
+    char *chunking = zconfig_resolve (self->config,
+        "fmq_server/delta_chunking", "content");
+    while (zlist_size (self->idle_hashers) && zlist_size (self->hash_jobs)) {
+        zsock_t *hasher = (zsock_t *) zlist_pop (self->idle_hashers);
+        update = (update_t *) zlist_pop (self->hash_jobs);
+        zsock_send (hasher, "spsi", "HASH", update,
+            zfile_filename (zdir_patch_file (update->patch), NULL),
+            !streq (chunking, "fixed"));
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return log2 (value) in 1/256ths, for value > 0
+
+static uint64_t
+s_log2 (uint64_t value)
+{
+    int shift = 0;
+    while ((value >> shift) > 1)
+        shift++;
+    uint64_t mantissa = (value << 16) >> shift;
+    uint64_t result = (uint64_t) shift << 8;
+    int bit;
+    for (bit = 128; bit; bit >>= 1) {
+        mantissa = (mantissa * mantissa) >> 16;
+        if (mantissa >= (2 << 16)) {
+            mantissa >>= 1;
+            result += bit;
+        }
+    }
+    return result;
+}
+
+//  Estimate the entropy of data, in 1/256ths of a bit per byte, from the
+//  byte frequencies of up to 64 KB sampled across it
+
+static uint64_t
+s_entropy (const byte *data, size_t size)
+{
+    uint32_t count [256] = { 0 };
+    size_t stride = size / 65536 + 1;
+    uint64_t samples = 0;
+    size_t index;
+    for (index = 0; index < size; index += stride) {
+        count [data [index]]++;
+        samples++;
+    }
+    if (samples == 0)
+        return 0;
+    uint64_t sum = 0;
+    for (index = 0; index < 256; index++)
+        if (count [index])
+            sum += count [index] * s_log2 (count [index]);
+    return s_log2 (samples) - sum / samples;
+}
+
+//  ---------------------------------------------------------------------------
+//  Client worker, which takes file messages the server prepared, reads
+//  their chunks from disk, compresses them if asked, and passes them back,
+//  in order, for sending. Each worker keeps its own file handles. Messages
+//  it can't or needn't compress come back as they are.
+//
+
+static void
+s_worker (zsock_t *pipe, void *args)
+{
+    zhash_t *files = zhash_new ();
+    zhash_t *failed = zhash_new ();
+    zhash_autofree (failed);
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+        char *command, *client, *filename;
+        fmq_msg_t *message;
+        uint64_t modified, offset, size;
+        int level;
+        if (zsock_recv (pipe, "ssps888i", &command, &client, &message,
+                        &filename, &modified, &offset, &size, &level))
+            break;              //  Interrupted
+        if (streq (command, "$TERM")) {
+            zstr_free (&command);
+            zstr_free (&client);
+            break;
+        }
+        //  Once we fail to read a chunk of a file for a client, we fail
+        //  the rest of the file too, so the client won't take them for a
+        //  new copy of it
+        const char *vpath = (const char *) zhash_lookup (failed, client);
+        if (vpath && streq (vpath, fmq_msg_filename (message))) {
+            zchunk_t *chunk = fmq_msg_chunk (message);
+            s_msg_set_failed (message, size + (chunk? zchunk_size (chunk): 0));
+            *filename = 0;
+        }
+        else
+            zhash_delete (failed, client);
+
+        if (*filename) {
+            //  Read the chunk with our handle on the file, opening it again
+            //  if it changed since we last did
+            zfile_t *file = (zfile_t *) zhash_lookup (files, filename);
+            if (file && (uint64_t) zfile_modified (file) != modified) {
+                zhash_delete (files, filename);
+                file = NULL;
+            }
+            if (!file) {
+                if (zhash_size (files) >= WORKER_FILES)
+                    zhash_purge (files);
+                file = zfile_new (NULL, filename);
+                zhash_insert (files, filename, file);
+                zhash_freefn (files, filename, s_file_free);
+                zfile_input (file);
+            }
+            zchunk_t *chunk = s_file_read (file, size, offset);
+            if (chunk)
+                fmq_msg_set_chunk (message, &chunk);
+            else {
+                s_msg_set_failed (message, size);
+                if (zhash_size (failed) >= WORKER_FILES)
+                    zhash_purge (failed);
+                zhash_insert (failed, client, (void *) fmq_msg_filename (message));
+            }
+        }
+#if defined (HAVE_LIBZSTD)
+        zchunk_t *chunk = fmq_msg_chunk (message);
+        size_t chunk_size = chunk? zchunk_size (chunk): 0;
+        if (level && fmq_msg_id (message) == FMQ_MSG_CHEEZBURGER
+        &&  fmq_msg_operation (message) == FMQ_MSG_FILE_CREATE && chunk_size
+        &&  s_entropy (zchunk_data (chunk), chunk_size) < ENTROPY_MAX) {
+            zchunk_t *packed = zchunk_new (NULL, ZSTD_compressBound (chunk_size));
+            size_t packed_size = ZSTD_compress (
+                zchunk_data (packed), zchunk_max_size (packed),
+                zchunk_data (chunk), chunk_size, level);
+            //  Not worth it unless we save an eighth
+            if (!ZSTD_isError (packed_size)
+            &&  packed_size < chunk_size - chunk_size / 8) {
+                zchunk_set (packed, NULL, packed_size);
+                fmq_msg_set_chunk (message, &packed);
+                zhash_t *headers = fmq_msg_get_headers (message);
+                if (!headers) {
+                    headers = zhash_new ();
+                    zhash_autofree (headers);
+                }
+                zhash_insert (headers, "codec", "zstd");
+                char value [32];
+                snprintf (value, sizeof (value), "%zu", chunk_size);
+                zhash_insert (headers, "size", value);
+                fmq_msg_set_headers (message, &headers);
+            }
+            zchunk_destroy (&packed);
+        }
+#endif
+        zsock_send (pipe, "ssp", "READY", client, message);
+        zstr_free (&filename);
+        zstr_free (&client);
+        zstr_free (&command);
+    }
+    zhash_destroy (&failed);
+    zhash_destroy (&files);
+}
+
+//  ---------------------------------------------------------------------------
+//  Client worker as the server sees it
+//
+
+struct _worker_t {
+    zactor_t *actor;            //  Worker thread
+    size_t queued;              //  Messages passed to it, not back yet
+    bool stalled;               //  Clients are waiting for it to catch up
+};
+
+//  ---------------------------------------------------------------------------
+//  Send a message coming back from a client worker, unless the client has
+//  gone, and wake up clients waiting for the worker once it has caught up
+
+static int
+s_server_handle_worker (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    server_t *self = (server_t *) argument;
+    char *command, *id;
+    fmq_msg_t *message;
+    if (zsock_recv (reader, "ssp", &command, &id, &message))
+        return -1;              //  Interrupted
+    client_t *client = (client_t *) zhash_lookup (self->clients, id);
+    if (client) {
+        s_msg_move (client->message, message);
+        engine_send_event (client,
+            fmq_msg_id (message) == FMQ_MSG_CHEEZBURGERS?
+            worker_bundle_event: worker_chunk_event);
+    }
+    fmq_msg_destroy (&message);
+    zstr_free (&id);
+    zstr_free (&command);
+
+    worker_t *worker = (worker_t *) zlist_first (self->workers);
+    while (zactor_sock (worker->actor) != reader)
+        worker = (worker_t *) zlist_next (self->workers);
+    worker->queued--;
+    if (worker->stalled && worker->queued <= WORKER_QUEUE / 2) {
+        worker->stalled = false;
+        engine_broadcast_event (self, NULL, dispatch_event);
+    }
+    return 0;
+}
+
+//  ---------------------------------------------------------------------------
+//  Carry on sending to clients that paused after a batch, now that the
+//  reactor has come round to us
+
+static int
+s_server_handle_nudge (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    server_t *self = (server_t *) argument;
+    char *command = zstr_recv (reader);
+    if (!command)
+        return -1;              //  Interrupted
+    zstr_free (&command);
+
+    //  Clients may pause again as we carry them on, so take the list
+    zlist_t *paused = self->paused;
+    self->paused = zlist_new ();
+    client_t *client;
+    while ((client = (client_t *) zlist_pop (paused))) {
+        client->paused = false;
+        engine_send_event (client, dispatch_event);
+    }
+    zlist_destroy (&paused);
+    return 0;
+}
+
+//  ---------------------------------------------------------------------------
+//  Constructor for a client worker, which we poll from the server reactor
+
+static worker_t *
+worker_new (server_t *server)
+{
+    worker_t *self = (worker_t *) zmalloc (sizeof (worker_t));
+    self->actor = zactor_new (s_worker, NULL);
+    assert (self->actor);
+    engine_handle_socket (server, self->actor, s_server_handle_worker);
+    return self;
+}
+
+//  ---------------------------------------------------------------------------
+//  Destructor for a client worker
+
+static void
+worker_destroy (worker_t **self_p, server_t *server)
+{
+    assert (self_p);
+    if (*self_p) {
+        worker_t *self = *self_p;
+        engine_handle_socket (server, self->actor, NULL);
+        zactor_destroy (&self->actor);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  ---------------------------------------------------------------------------
+//  Return the worker for a client, or NULL if fmq_server/workers is 0 and
+//  the client's messages don't need one. Clients are spread over the
+//  workers by our id, and each client sticks to one worker, so its messages
+//  stay in order. We start the workers when we first need them, like the
+//  hashing workers.
+//
+
+static worker_t *
+server_worker (server_t *self, client_t *client)
+{
+    char *value = zconfig_resolve (self->config, "fmq_server/workers", NULL);
+    if (!client->compress && value && atoi (value) < 1)
+        return NULL;
+
+    if (!self->workers) {
+        int workers = 4;
+#if defined (__UNIX__)
+        workers = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+        if (!value)
+            value = zconfig_resolve (self->config,
+                "fmq_server/compress_workers", NULL);
+        if (value)
+            workers = atoi (value);
+        if (workers < 1)
+            workers = 1;
+
+        self->workers = zlist_new ();
+        while (workers--)
+            zlist_append (self->workers, worker_new (self));
+    }
+    size_t index = strtoul (client->id, NULL, 10) % zlist_size (self->workers);
+    worker_t *worker = (worker_t *) zlist_first (self->workers);
+    while (index--)
+        worker = (worker_t *) zlist_next (self->workers);
+    return worker;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Monitor the servers published directories for changes
+//
+
+static int
+monitor_the_server (zloop_t *loop, int timer_id, void *arg)
+{
+    server_t *self = (server_t *) arg;
+    bool activity = false;
+    int64_t now = zclock_mono ();
+    char *value = zconfig_resolve (self->config,
+        "fmq_server/rescan_interval", NULL);
+    int rescan_interval = value? atoi (value): RESCAN_INTERVAL;
+
+    mount_t *mount = (mount_t *) zlist_first (self->mounts);
+    while (mount) {
+        //  Mounts we can't watch get a full scan on every tick
+        if (mount->watch == -1 || mount->rescan || now >= mount->rescan_at) {
+            if (mount_refresh (mount, self))
+                activity = true;
+            mount->rescan_at = now + rescan_interval;
+        }
+        mount = (mount_t *) zlist_next (self->mounts);
+    }
+    if (activity)
+        engine_broadcast_event (self, NULL, dispatch_event);
+
+    return 0;
+}
+
+//  Allocate properties and structures for a new server instance.
+//  Return 0 if OK, or -1 if there was an error.
+
+static int
+server_initialize (server_t *self)
+{
+    //  Construct properties here
+    zsys_notice ("starting filemq service");
+    self->clients = zhash_new ();
+    self->mounts = zlist_new ();
+    self->aliases = trie_new (NULL, "");
+    self->idle_hashers = zlist_new ();
+    self->hash_jobs = zlist_new ();
+    self->cache = zhash_new ();
+    self->cache_lru = zlistx_new ();
+    self->paused = zlist_new ();
+    self->nudge = zsys_create_pipe (&self->nudged);
+    engine_handle_socket (self, self->nudged, s_server_handle_nudge);
+    //  Register with the engine a function that will be called
+    //  every second by the engine.
+    engine_set_monitor (self, 1000, monitor_the_server);
+    return 0;
+}
+
+//  Free properties and structures for a server instance
+
+static void
+server_terminate (server_t *self)
+{
+    //  Destroy properties here
+    zsys_notice ("terminating filemq service");
+    //  Stop the workers first, as they refer to updates held by mounts
+    if (self->hashers) {
+        while (zlist_size (self->hashers)) {
+            zactor_t *hasher = (zactor_t *) zlist_pop (self->hashers);
+            engine_handle_socket (self, hasher, NULL);
+            zactor_destroy (&hasher);
+        }
+        zlist_destroy (&self->hashers);
+    }
+    if (self->workers) {
+        while (zlist_size (self->workers)) {
+            worker_t *worker = (worker_t *) zlist_pop (self->workers);
+            worker_destroy (&worker, self);
+        }
+        zlist_destroy (&self->workers);
+    }
+    engine_handle_socket (self, self->nudged, NULL);
+    zsock_destroy (&self->nudged);
+    zsock_destroy (&self->nudge);
+    zlist_destroy (&self->paused);
+    zlist_destroy (&self->idle_hashers);
+    zlist_destroy (&self->hash_jobs);
+    zlistx_destroy (&self->cache_lru);
+    zhash_destroy (&self->cache);
+    trie_destroy (&self->aliases);
+    while (zlist_size (self->mounts)) {
+        mount_t *mount = (mount_t *) zlist_pop (self->mounts);
+        mount_destroy (&mount);
+    }
+    zlist_destroy (&self->mounts);
+    zhash_destroy (&self->clients);
+}
+
+//  Process server API method, return reply message if any
+
+static zmsg_t *
+server_method (server_t *self, const char *method, zmsg_t *msg)
+{
+    if (streq (method, "PUBLISH")) {
+        char *location = zmsg_popstr (msg);
+        char *alias = zmsg_popstr (msg);
+        mount_t *mount = mount_new (self, location, alias);
+        zmsg_t *ret_msg = zmsg_new ();
+        if (mount) {
+            zlist_append (self->mounts, mount);
+            trie_insert (self->aliases, mount->alias, mount);
+            zmsg_addstr (ret_msg, "SUCCESS");
+        }
+        else
+            zmsg_addstr (ret_msg, "FAILURE");
+        free (location);
+        free (alias);
+        return ret_msg;
+    }
+    else
+    if (streq (method, "STATS")) {
+        //  Report per-client queue depth as name/value pairs
+        size_t clients = 0;
+        size_t queued = 0;
+        size_t max_queued = 0;
+        client_t *client = (client_t *) zhash_first (self->clients);
+        while (client) {
+            size_t depth = zlistx_size (client->patches);
+            clients++;
+            queued += depth;
+            if (max_queued < depth)
+                max_queued = depth;
+            client = (client_t *) zhash_next (self->clients);
+        }
+        zmsg_t *ret_msg = zmsg_new ();
+        zmsg_addstr (ret_msg, "STATS");
+        zmsg_addstr (ret_msg, "clients");
+        zmsg_addstrf (ret_msg, "%zu", clients);
+        zmsg_addstr (ret_msg, "queued");
+        zmsg_addstrf (ret_msg, "%zu", queued);
+        zmsg_addstr (ret_msg, "max_queued");
+        zmsg_addstrf (ret_msg, "%zu", max_queued);
+        zmsg_addstr (ret_msg, "hash_jobs");
+        zmsg_addstrf (ret_msg, "%zu", zlist_size (self->hash_jobs));
+        return ret_msg;
+    }
+    return NULL;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Set the client's chunk size from a configured or requested value, which
+//  is a size in bytes or "auto". Ignores a missing or invalid value.
+
+static void
+s_client_set_chunk_size (client_t *self, const char *value)
+{
+    if (!value)
+        return;
+    if (streq (value, "auto"))
+        self->chunk_auto = true;
+    else {
+        long size = atol (value);
+        if (size > 0) {
+            self->chunk_size = size < CHUNK_MIN? CHUNK_MIN:
+                               size > CHUNK_MAX? CHUNK_MAX: size;
+            self->chunk_auto = false;
+        }
+        else
+            zsys_warning ("invalid chunk_size '%s', ignored", value);
+    }
+}
+
+//  ---------------------------------------------------------------------------
+//  Return the size of the next chunk to send to the client. In auto mode
+//  this tracks the client's credit window. Either way a chunk is never more
+//  than the window, or a client with a small window would never have the
+//  credit for it.
+
+static size_t
+s_client_chunk_size (client_t *self)
+{
+    uint64_t size = self->chunk_size;
+    if (self->chunk_auto && self->window) {
+        size = self->window / 4;
+        size = size < CHUNK_MIN? CHUNK_MIN:
+               size > CHUNK_MAX? CHUNK_MAX: size;
+    }
+    if (self->window && size > self->window)
+        size = self->window;
+    return (size_t) size;
+}
+
+
+//  Allocate properties and structures for a new client connection and
+//  optionally engine_set_next_event (). Return 0 if OK, or -1 on error.
+
+static int
+client_initialize (client_t *self)
+{
+    //  Construct properties here
+    snprintf (self->id, sizeof (self->id), "%u", ++self->server->last_id);
+    zhash_insert (self->server->clients, self->id, self);
+    self->patches = zlistx_new ();
+    self->queued = zhash_new ();
+    self->deltas = zhash_new ();
+    self->wanted = zhash_new ();
+    self->resume = zhash_new ();
+    zhash_autofree (self->resume);
+    self->chunk_size = CHUNK_SIZE;
+    s_client_set_chunk_size (self, zconfig_resolve (self->server->config,
+        "fmq_server/chunk_size", NULL));
+    return 0;
+}
+
+//  Free properties and structures for a client connection
+
+static void
+client_terminate (client_t *self)
+{
+    //  Destroy properties here
+    zhash_delete (self->server->clients, self->id);
+    if (self->paused)
+        zlist_remove (self->server->paused, self);
+    mount_t *mount = (mount_t *) zlist_first (self->server->mounts);
+    while (mount) {
+        mount_sub_purge (mount, self);
+        mount = (mount_t *) zlist_next (self->server->mounts);
+    }
+    update_t *update;
+    while ((update = (update_t *) zlistx_detach (self->patches, NULL)))
+        update_destroy (&update);
+    zlistx_destroy (&self->patches);
+    zhash_destroy (&self->queued);
+    zhash_destroy (&self->deltas);
+    zhash_destroy (&self->wanted);
+    zhash_destroy (&self->resume);
+    zchunk_destroy (&self->ranges);
+    update_destroy (&self->update);
+    zfile_destroy (&self->file);
+    server_cache_release (self->server, &self->cached);
+}
+
+//  ---------------------------------------------------------------------------
+//  Selftest
 
 void
 fmq_server_test (bool verbose)
@@ -493,7 +3046,109 @@ fmq_server_test (bool verbose)
     if (verbose)
         printf ("\n");
 
-    //  @selftest
+    //  @selftest
+    //  Entropy probe: constant data has none, all byte values evenly
+    //  spread have eight bits per byte
+    byte sample [4096];
+    memset (sample, 'A', sizeof (sample));
+    assert (s_entropy (sample, sizeof (sample)) == 0);
+    size_t index;
+    for (index = 0; index < sizeof (sample); index++)
+        sample [index] = (byte) index;
+    assert (s_entropy (sample, sizeof (sample)) >= 8 * 256 - 2);
+    assert (s_entropy (sample, sizeof (sample)) > ENTROPY_MAX);
+
+    //  Path trie: items match paths at or below theirs, by component
+    char *year = "2024";
+    trie_t *trie = trie_new (NULL, "");
+    trie_insert (trie, "/", "root");
+    trie_insert (trie, "/photos", "photos");
+    trie_insert (trie, "/photos/2024/", year);
+    zlist_t *matches = zlist_new ();
+    trie_match (trie, "/photos/2024/june.jpg", matches);
+    assert (zlist_size (matches) == 3);
+    zlist_purge (matches);
+    trie_match (trie, "/photosets/june.jpg", matches);
+    assert (zlist_size (matches) == 1);
+    assert (streq ((char *) zlist_first (matches), "root"));
+    zlist_purge (matches);
+    trie_within (trie, "/photos", matches);
+    assert (zlist_size (matches) == 2);
+    assert (streq ((char *) trie_longest (trie, "/photos/2023"), "photos"));
+    trie_remove (trie, "/photos/2024", year);
+    assert (trie_node (trie, "/photos/2024", false) == NULL);
+    assert (streq ((char *) trie_longest (trie, "/photos/2024"), "photos"));
+    zlist_destroy (&matches);
+    trie_destroy (&trie);
+
+    //  Clients can't name paths that lead out of a mount
+    assert (s_path_safe (""));
+    assert (s_path_safe ("photos/2026/june.jpg"));
+    assert (s_path_safe ("photos/"));
+    assert (!s_path_safe ("photos/../../etc/passwd"));
+    assert (!s_path_safe ("/etc/passwd"));
+    assert (!s_path_safe ("photos//june.jpg"));
+    assert (!s_path_safe ("./june.jpg"));
+
+    //  Subscription filters are globs, by name or by relative path
+    assert (s_glob_match ("*.log", "error.log"));
+    assert (!s_glob_match ("*.log", "logs/error.txt"));
+    assert (s_glob_match ("raw/*.cr?", "raw/img1.cr2"));
+    assert (!s_glob_match ("raw/*", "raw/2026/img1.cr2"));
+    assert (s_glob_match ("raw/**", "raw/2026/img1.cr2"));
+    assert (s_glob_match ("**/*.cr2", "raw/2026/img1.cr2"));
+    assert (s_glob_match ("**/*.cr2", "img1.cr2"));
+    assert (s_glob_match ("**/foo", "foo"));
+    assert (s_glob_match ("raw/**/img1.cr2", "raw/img1.cr2"));
+    assert (!s_glob_match ("**/foo", "barfoo"));
+    assert (!s_glob_match ("**/*.cr2", "raw/2026/img1.cr2/notes"));
+    assert (!s_glob_match ("*a*a*a*a*a*a*a*a*a*a*b",
+        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
+    sub_t *sub = sub_new (NULL, "/photos", NULL, NULL);
+    zhash_t *filters = zhash_new ();
+    zhash_autofree (filters);
+    zhash_insert (filters, "include", "*.jpg\nraw/**");
+    zhash_insert (filters, "exclude", "/thumbs/**");
+    sub_set_filters (sub, filters);
+    zhash_destroy (&filters);
+    assert (sub_wants (sub, "/photos/2026/june.jpg"));
+    assert (sub_wants (sub, "/photos/raw/june.cr2"));
+    assert (!sub_wants (sub, "/photos/notes.txt"));
+    assert (!sub_wants (sub, "/photos/thumbs/june.jpg"));
+    assert (!sub_wants (sub, "/photosets/june.jpg"));
+    sub_destroy (&sub);
+
+    //  Chunks never outgrow the client's credit window
+    client_t probe;
+    memset (&probe, 0, sizeof (probe));
+    probe.chunk_size = 65536;
+    assert (s_client_chunk_size (&probe) == 65536);
+    probe.window = 1000;
+    assert (s_client_chunk_size (&probe) == 1000);
+    probe.chunk_auto = true;
+    probe.window = 40000;
+    assert (s_client_chunk_size (&probe) == CHUNK_MIN);
+    probe.window = 10000;
+    assert (s_client_chunk_size (&probe) == 10000);
+
+    //  A chunk we can't read in full is a failure, not padding
+    zfile_t *shrunk = zfile_new (NULL, ".fmq_server_selftest");
+    int rc = zfile_output (shrunk);
+    assert (rc == 0);
+    zchunk_t *content = zchunk_new ("Captcha Diem", 12);
+    rc = zfile_write (shrunk, content, 0);
+    assert (rc == 0);
+    zchunk_destroy (&content);
+    zfile_close (shrunk);
+    rc = zfile_input (shrunk);
+    assert (rc == 0);
+    content = s_file_read (shrunk, 12, 0);
+    assert (content && zchunk_size (content) == 12);
+    zchunk_destroy (&content);
+    assert (s_file_read (shrunk, 12, 6) == NULL);
+    zfile_remove (shrunk);
+    zfile_destroy (&shrunk);
+
     zactor_t *server = zactor_new (fmq_server, "server");
     if (verbose)
         zstr_send (server, "VERBOSE");
@@ -509,16 +3164,306 @@ fmq_server_test (bool verbose)
     fmq_msg_send (message, client);
     fmq_msg_recv (message, client);
     assert (fmq_msg_id (message) == FMQ_MSG_OHAI_OK);
+
+    //  One connected client with nothing queued
+    zstr_send (server, "STATS");
+    zmsg_t *stats = zmsg_recv (server);
+    assert (zmsg_size (stats) == 9);
+    char *command = zmsg_popstr (stats);
+    assert (streq (command, "STATS"));
+    zstr_free (&command);
+    const char *expected [] = {
+        "clients", "1", "queued", "0", "max_queued", "0", "hash_jobs", "0"
+    };
+    for (index = 0; index < 8; index++) {
+        char *field = zmsg_popstr (stats);
+        assert (streq (field, expected [index]));
+        zstr_free (&field);
+    }
+    zmsg_destroy (&stats);
+
+    fmq_msg_set_id (message, FMQ_MSG_KTHXBAI);
+    fmq_msg_send (message, client);
+    zsock_destroy (&client);
+
+    //  Dispatch 64 KB chunks pausing for the reactor after each one, then
+    //  in batches, then read and sent by client workers. We check each with a few
+    //  chunks; when verbose, we send 8 MB each and report the rate.
+    rc = zsys_dir_create ("./fmqbench");
+    assert (rc == 0);
+    zstr_sendx (server, "SET", "fmq_server/chunk_size", "65536", NULL);
+    zstr_sendx (server, "SET", "fmq_server/workers", "0", NULL);
+    zstr_sendx (server, "PUBLISH", "./fmqbench", "/bench", NULL);
+    char *response = zstr_recv (server);
+    assert (streq (response, "SUCCESS"));
+    zstr_free (&response);
+
+    client = zsock_new (ZMQ_DEALER);
+    assert (client);
+    zsock_set_rcvtimeo (client, 5000);
+    zsock_connect (client, "ipc://fmq_server");
+    fmq_msg_set_id (message, FMQ_MSG_OHAI);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_OHAI_OK);
+    fmq_msg_set_id (message, FMQ_MSG_ICANHAZ);
+    fmq_msg_set_path (message, "/bench");
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_ICANHAZ_OK);
+    fmq_msg_set_id (message, FMQ_MSG_NOM);
+    fmq_msg_set_credit (message, 64000000);
+    fmq_msg_send (message, client);
+
+    const char *batches [] = { "1", "64", "64" };
+    const char *workers [] = { "0", "0", "4" };
+    int run;
+    for (run = 0; run < 3; run++) {
+        zstr_sendx (server, "SET", "fmq_server/dispatch_batch", batches [run], NULL);
+        zstr_sendx (server, "SET", "fmq_server/workers", workers [run], NULL);
+        char filename [32];
+        snprintf (filename, sizeof (filename), "bench%d.dat", run);
+        zfile_t *file = zfile_new ("./fmqbench", filename);
+        rc = zfile_output (file);
+        assert (rc == 0);
+        size_t block_size = verbose? 1000000: 65536;
+        zchunk_t *chunk = zchunk_new (NULL, block_size);
+        zchunk_fill (chunk, 'x', block_size);
+        int block;
+        for (block = 0; block < (verbose? 8: 4); block++) {
+            rc = zfile_write (file, chunk, block * block_size);
+            assert (rc == 0);
+        }
+        zchunk_destroy (&chunk);
+        zfile_close (file);
+
+        //  Time from the first chunk to the last
+        int64_t started = 0;
+        size_t chunks = 0;
+        while (true) {
+            rc = fmq_msg_recv (message, client);
+            assert (rc == 0);
+            assert (fmq_msg_id (message) == FMQ_MSG_CHEEZBURGER);
+            //  Skip the delete of the last run's file
+            if (fmq_msg_operation (message) != FMQ_MSG_FILE_CREATE
+            ||  !strstr (fmq_msg_filename (message), filename))
+                continue;
+            if (!started)
+                started = zclock_usecs ();
+            chunks++;
+            if (fmq_msg_eof (message))
+                break;
+        }
+        //  Each chunk of the file, then the end of file
+        assert (chunks == (verbose? 8 * 1000000 / 65536 + 2: 5));
+        int64_t elapsed = zclock_usecs () - started;
+        if (verbose)
+            zsys_info ("dispatch_batch=%s workers=%s: %zu chunks, %d chunks/sec",
+                batches [run], workers [run], chunks,
+                elapsed? (int) (chunks * 1000000 / elapsed): 0);
+        zfile_remove (file);
+        zfile_destroy (&file);
+    }
+    fmq_msg_set_id (message, FMQ_MSG_KTHXBAI);
+    fmq_msg_send (message, client);
+    zsock_destroy (&client);
+
+    //  A client that has part of a file gets the rest of it
+    zfile_t *file = zfile_new ("./fmqbench", "resume.dat");
+    rc = zfile_output (file);
+    assert (rc == 0);
+    zchunk_t *chunk = zchunk_new (NULL, 200000);
+    zchunk_fill (chunk, 'r', 200000);
+    rc = zfile_write (file, chunk, 0);
+    assert (rc == 0);
+    zchunk_destroy (&chunk);
+    zfile_close (file);
+    char *resume = zsys_sprintf ("150000 %s /bench/resume.dat\n",
+        zfile_digest (file));
+
+    client = zsock_new (ZMQ_DEALER);
+    assert (client);
+    zsock_set_rcvtimeo (client, 5000);
+    zsock_connect (client, "ipc://fmq_server");
+    fmq_msg_set_id (message, FMQ_MSG_OHAI);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_OHAI_OK);
+    fmq_msg_set_id (message, FMQ_MSG_ICANHAZ);
+    fmq_msg_set_path (message, "/bench");
+    zhash_t *options = zhash_new ();
+    zhash_autofree (options);
+    zhash_insert (options, "resume", resume);
+    fmq_msg_set_options (message, &options);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_ICANHAZ_OK);
+    fmq_msg_set_id (message, FMQ_MSG_NOM);
+    fmq_msg_set_credit (message, 1000000);
+    fmq_msg_send (message, client);
+
+    rc = fmq_msg_recv (message, client);
+    assert (rc == 0);
+    assert (fmq_msg_id (message) == FMQ_MSG_CHEEZBURGER);
+    assert (streq (fmq_msg_filename (message), "/bench/resume.dat"));
+    assert (fmq_msg_offset (message) == 150000);
+    assert (zchunk_size (fmq_msg_chunk (message)) == 50000);
+    assert (fmq_msg_headers (message));
+    assert (streq ((char *) zhash_lookup (fmq_msg_headers (message), "digest"),
+                   zfile_digest (file)));
+    zstr_free (&resume);
+    zfile_remove (file);
+    zfile_destroy (&file);
+
+    fmq_msg_set_id (message, FMQ_MSG_KTHXBAI);
+    fmq_msg_send (message, client);
+    zsock_destroy (&client);
+
+    //  A client that asks for ranges of a file twice gets both, in order
+    file = zfile_new ("./fmqbench", "ranges.dat");
+    rc = zfile_output (file);
+    assert (rc == 0);
+    chunk = zchunk_new (NULL, 10000);
+    zchunk_fill (chunk, 'm', 10000);
+    rc = zfile_write (file, chunk, 0);
+    assert (rc == 0);
+    zchunk_destroy (&chunk);
+    zfile_close (file);
+
+    client = zsock_new (ZMQ_DEALER);
+    assert (client);
+    zsock_set_rcvtimeo (client, 5000);
+    zsock_connect (client, "ipc://fmq_server");
+    fmq_msg_set_id (message, FMQ_MSG_OHAI);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_OHAI_OK);
+    fmq_msg_set_id (message, FMQ_MSG_ICANHAZ);
+    fmq_msg_set_path (message, "/bench");
+    options = zhash_new ();
+    zhash_autofree (options);
+    zhash_insert (options, "resync", "1");
+    fmq_msg_set_options (message, &options);
+    zhash_t *cache = zhash_new ();
+    zhash_autofree (cache);
+    zhash_insert (cache, "/bench/ranges.dat", (char *) zfile_digest (file));
+    fmq_msg_set_cache (message, &cache);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_ICANHAZ_OK);
+
+    uint64_t starts [] = { 0, 5000 };
+    for (index = 0; index < 2; index++) {
+        byte range [16] = { 0 };
+        int octet;
+        for (octet = 0; octet < 8; octet++) {
+            range [7 - octet] = (byte) (starts [1 - index] >> (octet * 8));
+            range [15 - octet] = (byte) (1000 >> (octet * 8));
+        }
+        chunk = zchunk_new (range, sizeof (range));
+        fmq_msg_set_id (message, FMQ_MSG_MOAR);
+        fmq_msg_set_filename (message, "/bench/ranges.dat");
+        fmq_msg_set_ranges (message, &chunk);
+        fmq_msg_send (message, client);
+    }
+    fmq_msg_set_id (message, FMQ_MSG_NOM);
+    fmq_msg_set_credit (message, 1000000);
+    fmq_msg_send (message, client);
+
+    for (index = 0; index < 3; index++) {
+        rc = fmq_msg_recv (message, client);
+        assert (rc == 0);
+        assert (fmq_msg_id (message) == FMQ_MSG_CHEEZBURGER);
+        assert (streq (fmq_msg_filename (message), "/bench/ranges.dat"));
+        assert (fmq_msg_eof (message) == (index == 2));
+        if (index < 2) {
+            assert (fmq_msg_offset (message) == starts [index]);
+            assert (zchunk_size (fmq_msg_chunk (message)) == 1000);
+        }
+    }
+    zfile_remove (file);
+    zfile_destroy (&file);
+
+    fmq_msg_set_id (message, FMQ_MSG_KTHXBAI);
+    fmq_msg_send (message, client);
+    zsock_destroy (&client);
+
+    //  A client on this host can copy chunks from our files itself
+    zstr_sendx (server, "SET", "fmq_server/local_copy", "1", NULL);
+    file = zfile_new ("./fmqbench", "local.dat");
+    rc = zfile_output (file);
+    assert (rc == 0);
+    chunk = zchunk_new (NULL, 1000);
+    zchunk_fill (chunk, 'l', 1000);
+    rc = zfile_write (file, chunk, 0);
+    assert (rc == 0);
+    zchunk_destroy (&chunk);
+    zfile_close (file);
+
+    client = zsock_new (ZMQ_DEALER);
+    assert (client);
+    zsock_set_rcvtimeo (client, 5000);
+    zsock_connect (client, "ipc://fmq_server");
+    fmq_msg_set_id (message, FMQ_MSG_OHAI);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_OHAI_OK);
+    fmq_msg_set_id (message, FMQ_MSG_ICANHAZ);
+    fmq_msg_set_path (message, "/bench");
+    options = zhash_new ();
+    zhash_autofree (options);
+    zhash_insert (options, "resync", "1");
+    zhash_insert (options, "local", "1");
+    fmq_msg_set_options (message, &options);
+    fmq_msg_send (message, client);
+    fmq_msg_recv (message, client);
+    assert (fmq_msg_id (message) == FMQ_MSG_ICANHAZ_OK);
+    fmq_msg_set_id (message, FMQ_MSG_NOM);
+    fmq_msg_set_credit (message, 1000000);
+    fmq_msg_send (message, client);
+
+    do {
+        rc = fmq_msg_recv (message, client);
+        assert (rc == 0);
+        assert (fmq_msg_id (message) == FMQ_MSG_CHEEZBURGER);
+    } while (!streq (fmq_msg_filename (message), "/bench/local.dat"));
+    assert (zchunk_size (fmq_msg_chunk (message)) == 0);
+    assert (fmq_msg_headers (message));
+    assert (streq ((char *) zhash_lookup (fmq_msg_headers (message), "length"),
+                   "1000"));
+    char *source = (char *) zhash_lookup (fmq_msg_headers (message), "source");
+    assert (source && streq (source, "/bench/local.dat"));
+    zfile_remove (file);
+    zfile_destroy (&file);
+
     fmq_msg_set_id (message, FMQ_MSG_KTHXBAI);
     fmq_msg_send (message, client);
     fmq_msg_destroy (&message);
 
     zsock_destroy (&client);
     zactor_destroy (&server);
+    zsys_dir_delete ("./fmqbench");
     //  @end
     printf ("OK\n");
 }
 
+//  ---------------------------------------------------------------------------
+//  Find the mount point with the longest match to a subscription path
+//
+
+static mount_t *
+s_server_mount (server_t *self, const char *path)
+{
+    mount_t *mount = (mount_t *) trie_longest (self->aliases, path);
+    if (mount)
+        zsys_debug ("path=%s, mount->alias=%s", path, mount->alias);
+    else
+        //  No alias matches the path, so use the first mount, if any
+        mount = (mount_t *) zlist_first (self->mounts);
+    return mount;
+}
+
+
 //  ---------------------------------------------------------------------------
 //  store_client_subscription
 //
@@ -526,28 +3471,55 @@ fmq_server_test (bool verbose)
 static void
 store_client_subscription (client_t *self)
 {
-    //  Find mount point with longest match to subscription
-    const char *path = fmq_msg_path (self->message);
-
-    mount_t *check = (mount_t *) zlist_first (self->server->mounts);
-    mount_t *mount = check;
-    while (check) {
-        //  If check->alias is prefix of path and alias is
-        //  longer than current mount then we have a new mount
-        zsys_debug ("path=%s, check->alias=%s, mount->alias=%s",
-            path, check->alias, mount->alias);
-        if (strncmp (path, check->alias, strlen (check->alias)) == 0
-        &&  strlen (check->alias) > strlen (mount->alias)) {
-            zsys_debug ("prefix match, alias is longer");
-            mount = check;
+    mount_t *mount = s_server_mount (self->server,
+                                     fmq_msg_path (self->message));
+    //  Client may have part of some files, as lines of "bytes digest vpath"
+    zhash_t *options = fmq_msg_options (self->message);
+    char *resume = options? (char *) zhash_lookup (options, "resume"): NULL;
+    while (resume && *resume) {
+        size_t length = strcspn (resume, "\n");
+        char *line = (char *) zmalloc (length + 1);
+        memcpy (line, resume, length);
+        resume += length + (resume [length] == '\n');
+        unsigned long long bytes;
+        char digest [41];
+        int offset = 0;
+        if (sscanf (line, "%llu %40s%n", &bytes, digest, &offset) == 2
+        &&  line [offset] == ' ') {
+            char *progress = zsys_sprintf ("%llu %s", bytes, digest);
+            zhash_update (self->resume, line + offset + 1, progress);
+            zstr_free (&progress);
         }
-        check = (mount_t *) zlist_next (self->server->mounts);
+        free (line);
     }
     //  If subscription matches nothing, discard it
     if (mount) {
         zsys_debug ("new subscription being stored");
         mount_sub_store (mount, self, self->message);
     }
+    //  Client may ask for a different chunk size
+    if (options) {
+        s_client_set_chunk_size (self,
+            (char *) zhash_lookup (options, "chunk_size"));
+        char *bundle = (char *) zhash_lookup (options, "bundle");
+        if (bundle)
+            self->bundle = atoi (bundle) == 1;
+        char *delta = (char *) zhash_lookup (options, "delta");
+        if (delta)
+            self->delta = atoi (delta) == 1;
+#if defined (HAVE_LIBZSTD)
+        char *compress = (char *) zhash_lookup (options, "compress");
+        if (compress)
+            self->compress = strstr (compress, "zstd") != NULL;
+#endif
+        //  A client on this host may copy chunks from our files itself,
+        //  if we trust it to read them and it knows where they are
+        char *local = (char *) zhash_lookup (options, "local");
+        char *allowed = zconfig_resolve (self->server->config,
+            "fmq_server/local_copy", "0");
+        if (local)
+            self->local = atoi (local) == 1 && atoi (allowed) == 1;
+    }
 }
 
 //  ---------------------------------------------------------------------------
@@ -563,10 +3535,18 @@ check_for_client_data (client_t *self)
         return;
     }
 
-    if (zlist_size (self->patches) == 0 && self->patch == NULL) {
+    char *value = zconfig_resolve (self->server->config,
+        "fmq_server/dispatch_batch", NULL);
+    size_t batch = value? atoi (value): DISPATCH_BATCH;
+    if (zlistx_size (self->patches) == 0 && self->update == NULL) {
         zsys_debug ("^^^ client has no patches, finished event ^^^");
         engine_set_next_event (self, finished_event);
     }
+    else
+    if (batch && self->batched >= batch) {
+        zsys_debug ("^^^ client sent a batch, pause event ^^^");
+        engine_set_next_event (self, pause_event);
+    }
     else {
         zsys_debug ("^^^ client has patches, send chunk event ^^^");
         engine_set_next_event (self, send_chunk_event);
@@ -582,100 +3562,604 @@ static void
 store_client_credit (client_t *self)
 {
     self->credit += fmq_msg_credit (self->message);
+    self->window = self->credit;
+}
+
+
+//  Ranges are a 64-bit start then a 64-bit length, both in network order,
+//  so comparing the bytes compares the starts
+
+static int
+s_compare_ranges (const void *range1, const void *range2)
+{
+    return memcmp (range1, range2, 16);
 }
 
 
 //  ---------------------------------------------------------------------------
-//  get_next_patch_for_client
+//  store_client_ranges
 //
 
 static void
-get_next_patch_for_client (client_t *self)
+store_client_ranges (client_t *self)
 {
-    zsys_debug ("@@ get_next_patch_for_client");
-    //  Get next patch for client if we're not doing one already
-    if (self->patch == NULL) {
-        self->patch = (zdir_patch_t *) zlist_pop (self->patches);
-        if (self->patch) {
-            zsys_debug ("~~~ just popped following patch ~~~");
-            zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
-                zdir_patch_path (self->patch), zdir_patch_op (self->patch),
-                zdir_patch_vpath (self->patch));
+    const char *vpath = fmq_msg_filename (self->message);
+
+    //  If the client asked for ranges of the file before, and we haven't
+    //  started on them yet, it gets these too. No ranges means the whole
+    //  file, which covers any others.
+    zchunk_t *wanted = (zchunk_t *) zhash_lookup (self->wanted, vpath);
+    if (wanted) {
+        zchunk_t *ranges = fmq_msg_ranges (self->message);
+        if (!ranges || zchunk_size (ranges) == 0)
+            zchunk_set (wanted, NULL, 0);
+        else
+        if (zchunk_size (wanted)) {
+            zchunk_extend (wanted, zchunk_data (ranges), zchunk_size (ranges));
+            //  We send ranges in order, so keep them sorted by start
+            qsort (zchunk_data (wanted), zchunk_size (wanted) / 16, 16,
+                   s_compare_ranges);
         }
+        return;
+    }
+    update_t *update = (update_t *) zhash_lookup (self->deltas, vpath);
+    if (update) {
+        zhash_freefn (self->deltas, vpath, NULL);
+        zhash_delete (self->deltas, vpath);
     }
     else {
-        zsys_debug ("~~~ current patch ~~~");
-        zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
-            zdir_patch_path (self->patch), zdir_patch_op (self->patch),
-            zdir_patch_vpath (self->patch));
+        //  Not waiting for this file, so the client wants it again
+        mount_t *mount = s_server_mount (self->server, vpath);
+        if (mount)
+            update = mount_file_update (mount, self, vpath);
+        if (!update)
+            return;             //  No such file for this client, ignore it
     }
-    if (self->patch == NULL) {
-        zsys_debug ("~~~ no patch ~~~");
-        engine_set_next_event (self, finished_event);
+
+    //  If the file changed again since, the newer patch supersedes this one
+    if (zhash_lookup (self->queued, vpath)
+    || (self->update && streq (zdir_patch_vpath (self->update->patch), vpath))) {
+        update_destroy (&update);
         return;
     }
+    //  Send the ranges next, ahead of other updates
+    void *handle = zlistx_add_start (self->patches, update);
+    zhash_insert (self->queued, vpath, handle);
+    zchunk_t *ranges = fmq_msg_get_ranges (self->message);
+    if (!ranges)
+        ranges = zchunk_new (NULL, 0);
+    int rc = zhash_insert (self->wanted, vpath, ranges);
+    assert (rc == 0);
+    zhash_freefn (self->wanted, vpath, s_chunk_free);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Set message chunk from the server's chunk cache, reading the chunk from
+//  disk and caching it if we're the first client to send it. Returns false
+//  if we couldn't read it.
+
+static bool
+s_client_set_cached_chunk (client_t *self, size_t chunk_size)
+{
+    char key [PATH_MAX + 64];
+    snprintf (key, sizeof (key), "%s:%ld:%ld:%ld:%ld",
+        zfile_filename (self->file, NULL),
+        (long) zfile_modified (self->file),
+        (long) zfile_cursize (self->file),
+        (long) self->offset, (long) chunk_size);
+
+    self->cached = server_cache_lookup (self->server, key);
+    if (!self->cached) {
+        zchunk_t *chunk = s_file_read (self->file, chunk_size, self->offset);
+        if (!chunk)
+            return false;
+        self->cached = server_cache_store (self->server, key, &chunk);
+    }
+    zchunk_t *chunk = shared_chunk (self->cached->chunk);
+    fmq_msg_set_chunk (self->message, &chunk);
+    return true;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Tell a client on this host to copy the next chunk itself, instead of
+//  sending it, as "source" and "length" headers on an empty chunk. The
+//  source is the virtual path, which the client finds under the root it
+//  was given for our files, so we don't tell it how we lay them out.
+
+static void
+s_client_set_source (client_t *self, size_t chunk_size)
+{
+    const char *source = zdir_patch_vpath (self->update->patch);
+    zhash_t *headers = fmq_msg_get_headers (self->message);
+    if (!headers) {
+        headers = zhash_new ();
+        zhash_autofree (headers);
+    }
+    zhash_update (headers, "source", (char *) source);
+    char length [32];
+    snprintf (length, sizeof (length), "%zu", chunk_size);
+    zhash_update (headers, "length", length);
+    fmq_msg_set_headers (self->message, &headers);
+    zchunk_t *chunk = zchunk_new (NULL, 0);
+    fmq_msg_set_chunk (self->message, &chunk);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Ask the kernel to read the next few chunks of the current file into
+//  its cache while we send this one, so that reading each chunk, on the
+//  server thread or on a worker, seldom waits for the disk.
+
+static void
+s_client_read_ahead (client_t *self, size_t chunk_size)
+{
+#if defined (__UTYPE_LINUX) && defined (POSIX_FADV_WILLNEED)
+    char *value = zconfig_resolve (self->server->config,
+        "fmq_server/read_ahead", NULL);
+    off_t chunks = value? atoi (value): READ_AHEAD;
+    off_t target = self->offset + (chunks + 1) * (off_t) chunk_size;
+    if (target > zfile_cursize (self->file))
+        target = zfile_cursize (self->file);
+    off_t start = self->advised > self->offset? self->advised: self->offset;
+    FILE *handle = zfile_handle (self->file);
+    if (chunks > 0 && handle && target > start) {
+        posix_fadvise (fileno (handle), start, target - start,
+                       POSIX_FADV_WILLNEED);
+        self->advised = target;
+    }
+#endif
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if the patch creates a file small enough to bundle
+
+static bool
+s_client_bundles (client_t *self, zdir_patch_t *patch)
+{
+    return zdir_patch_op (patch) == patch_create
+        && zfile_cursize (zdir_patch_file (patch)) < (off_t) s_client_chunk_size (self);
+}
+
+//  ---------------------------------------------------------------------------
+//  Append a 4-octet size in network order, then data, to a bundle
+
+static void
+s_bundle_put (zchunk_t *bundle, const void *data, size_t size)
+{
+    byte header [4];
+    header [0] = (byte) (size >> 24);
+    header [1] = (byte) (size >> 16);
+    header [2] = (byte) (size >> 8);
+    header [3] = (byte) size;
+    zchunk_extend (bundle, header, 4);
+    zchunk_extend (bundle, data, size);
+}
+
+//  ---------------------------------------------------------------------------
+//  Prepare a CHEEZBURGER with the block digests of the current file, and
+//  park the update until the client answers with the ranges it wants
+
+static event_t
+s_client_offer_delta (client_t *self)
+{
+    shared_t *blocks = self->update->blocks;
+    if (shared_size (blocks) > self->credit)
+        return no_credit_event;
+
+    fmq_msg_set_sequence (self->message, self->sequence++);
+    fmq_msg_set_operation (self->message, FMQ_MSG_FILE_DELTA);
+    fmq_msg_set_offset (self->message, 0);
+    fmq_msg_set_eof (self->message, 0);
+    zchunk_t *chunk = shared_chunk (blocks);
+    fmq_msg_set_chunk (self->message, &chunk);
+    self->credit -= shared_size (blocks);
+
+    const char *vpath = zdir_patch_vpath (self->update->patch);
+    zhash_insert (self->deltas, vpath, self->update);
+    zhash_freefn (self->deltas, vpath, s_update_free);
+    self->update = NULL;
+    return NULL_event;
+}
+
+//  ---------------------------------------------------------------------------
+//  Move the offset to the next byte the client asked for, and return the
+//  end of the range that holds it. When no ranges are left, move it to the
+//  end of the file, so we send end of file next.
+
+static off_t
+s_client_next_range (client_t *self, off_t size)
+{
+    size_t count = zchunk_size (self->ranges) / 16;
+    while (self->range < count) {
+        byte *entry = zchunk_data (self->ranges) + self->range * 16;
+        uint64_t start = 0, length = 0;
+        int index;
+        for (index = 0; index < 8; index++) {
+            start = (start << 8) + entry [index];
+            length = (length << 8) + entry [8 + index];
+        }
+        off_t end = size;
+        if (length && start + length < (uint64_t) size)
+            end = (off_t) (start + length);
+        if (self->offset < (off_t) start)
+            self->offset = (off_t) start;
+        if (self->offset < end)
+            return end;
+        self->range++;
+    }
+    self->offset = size;
+    return size;
+}
+
+//  ---------------------------------------------------------------------------
+//  Prepare a CHEEZBURGERS for the client, packing whole small files from
+//  the head of its queue until the next would not fit in a chunk or in the
+//  client's credit. Files can grow after we look at them, so we go by what
+//  we read, not by what we saw. Returns NULL_event if the message is ready
+//  to send, no_credit_event if the client can't take the first file yet,
+//  or finished_event if we have nothing to bundle after all: the files
+//  had gone, or the first is no longer small and we send it as usual.
+
+static event_t
+s_client_next_bundle (client_t *self)
+{
+    size_t limit = s_client_chunk_size (self);
+    if ((uint64_t) zfile_cursize (zdir_patch_file (self->update->patch)) > self->credit)
+        return no_credit_event;
+
+    server_cache_release (self->server, &self->cached);
+    zchunk_t *bundle = zchunk_new (NULL, limit);
+    size_t bundle_size = 0;
+    event_t event = NULL_event;
+    while (self->update) {
+        zdir_patch_t *patch = self->update->patch;
+        zfile_t *file = zfile_dup (zdir_patch_file (patch));
+        //  Read a byte more than fits, to see if the file still does
+        size_t room = limit;
+        if (room > self->credit)
+            room = (size_t) self->credit;
+        room -= bundle_size;
+        zchunk_t *data = NULL;
+        if (zfile_input (file) == 0)
+            data = zfile_read (file, room + 1, 0);
+        if (data && zchunk_size (data) > room) {
+            zchunk_destroy (&data);
+            if (bundle_size == 0) {
+                if (room < limit)
+                    event = no_credit_event;
+                else {
+                    //  Send it in chunks, as it is now
+                    self->file = file;
+                    file = NULL;
+                    zfile_restat (self->file);
+                    self->offset = 0;
+                    self->advised = 0;
+                    self->fresh = true;
+                    event = finished_event;
+                }
+            }
+            //  Otherwise it goes first in the next message
+            zfile_destroy (&file);
+            break;
+        }
+        //  A file that is no longer available is skipped
+        if (data) {
+            const char *vpath = zdir_patch_vpath (patch);
+            s_bundle_put (bundle, vpath, strlen (vpath));
+            s_bundle_put (bundle, zchunk_data (data), zchunk_size (data));
+            bundle_size += zchunk_size (data);
+            zchunk_destroy (&data);
+        }
+        zfile_destroy (&file);
+        update_destroy (&self->update);
+
+        //  Take the next update too, if it's another small file that fits
+        update_t *next = (update_t *) zlistx_first (self->patches);
+        if (next && s_client_bundles (self, next->patch)
+        &&  !zhash_lookup (self->wanted, zdir_patch_vpath (next->patch))) {
+            size_t size = zfile_cursize (zdir_patch_file (next->patch));
+            if (bundle_size + size <= limit
+            &&  bundle_size + size <= self->credit) {
+                self->update = (update_t *) zlistx_detach (self->patches, NULL);
+                zhash_delete (self->queued, zdir_patch_vpath (next->patch));
+            }
+        }
+    }
+    if (zchunk_size (bundle) == 0) {
+        zchunk_destroy (&bundle);
+        return event? event: finished_event;
+    }
+    fmq_msg_set_id (self->message, FMQ_MSG_CHEEZBURGERS);
+    fmq_msg_set_sequence (self->message, self->sequence++);
+    fmq_msg_set_chunk (self->message, &bundle);
+    self->credit -= bundle_size;
+    return NULL_event;
+}
+
+//  ---------------------------------------------------------------------------
+//  Prepare the next CHEEZBURGER for the client in the message. Returns
+//  NULL_event if the message is ready to send, no_credit_event if the
+//  client can't take the next chunk yet, or finished_event if there is
+//  nothing left to send.
+
+static event_t
+s_client_next_chunk (client_t *self)
+{
+    //  We skip files that are no longer available, so go round until we
+    //  have a message ready or nothing left to send
+    zhash_t *headers = NULL;
+    while (true) {
+        //  Get next patch for client if we're not doing one already
+        if (self->update == NULL) {
+            self->update = (update_t *) zlistx_detach (self->patches, NULL);
+            if (self->update) {
+                const char *vpath = zdir_patch_vpath (self->update->patch);
+                zhash_delete (self->queued, vpath);
+                //  Client may have asked for only some ranges of the file
+                self->ranges = (zchunk_t *) zhash_lookup (self->wanted, vpath);
+                if (self->ranges) {
+                    zhash_freefn (self->wanted, vpath, NULL);
+                    zhash_delete (self->wanted, vpath);
+                    self->range = 0;
+                }
+                zsys_debug ("~~~ just popped following patch ~~~");
+                zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
+                    zdir_patch_path (self->update->patch),
+                    zdir_patch_op (self->update->patch),
+                    zdir_patch_vpath (self->update->patch));
+            }
+        }
+        else {
+            zsys_debug ("~~~ current patch ~~~");
+            zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
+                zdir_patch_path (self->update->patch),
+                zdir_patch_op (self->update->patch),
+                zdir_patch_vpath (self->update->patch));
+        }
+        if (self->update == NULL) {
+            zsys_debug ("~~~ no patch ~~~");
+            return finished_event;
+        }
+        zdir_patch_t *patch = self->update->patch;
+
+        //  Send small files whole, in bundles, if the client wants that
+        if (self->bundle && self->file == NULL && !self->ranges
+        &&  s_client_bundles (self, patch)) {
+            event_t event = s_client_next_bundle (self);
+            if (event == finished_event)
+                continue;       //  Nothing to bundle after all
+            return event;
+        }
+        //  Get virtual path from patch
+        fmq_msg_set_id (self->message, FMQ_MSG_CHEEZBURGER);
+        fmq_msg_set_filename (self->message, zdir_patch_vpath (patch));
+        fmq_msg_set_headers (self->message, &headers);
+
+        //  Create patch refers to file, open that for input if needed
+        if (zdir_patch_op (patch) != patch_create || self->file)
+            break;
+        zsys_debug ("~~~ client's file is NULL ~~~");
+        //  Offer block digests first, if the client takes them, and
+        //  isn't already working out what it needs of this file
+        const char *vpath = zdir_patch_vpath (patch);
+        char *progress = (char *) zhash_lookup (self->resume, vpath);
+        if (self->delta && self->update->blocks && !self->ranges
+        &&  !progress && !zhash_lookup (self->deltas, vpath))
+            return s_client_offer_delta (self);
 
-    //  Get virtual path from patch
-    fmq_msg_set_filename (self->message, zdir_patch_vpath (self->patch));
+        self->file = zfile_dup (zdir_patch_file (patch));
+        if (zfile_input (self->file) == 0) {
+            //  We send the file as it is now; later changes get a new patch
+            zfile_restat (self->file);
+            self->offset = 0;
+            self->advised = 0;
+            self->fresh = true;
+
+            //  Carry on from where the client got to, if it has part of
+            //  this very file
+            if (progress) {
+                unsigned long long bytes;
+                char digest [41];
+                if (sscanf (progress, "%llu %40s", &bytes, digest) == 2
+                &&  self->update->digest && streq (digest, self->update->digest)
+                &&  bytes <= (unsigned long long) zfile_cursize (self->file)
+                &&  !self->ranges) {
+                    zsys_debug ("resuming %s at %llu", vpath, bytes);
+                    self->offset = (off_t) bytes;
+                }
+                zhash_delete (self->resume, vpath);
+            }
+            break;
+        }
+        //  File no longer available, skip it
+        zsys_debug ("~~~ file no longer available ~~~");
+        update_destroy (&self->update);
+        zfile_destroy (&self->file);
+        zchunk_destroy (&self->ranges);
+    }
+    zdir_patch_t *patch = self->update->patch;
 
     //  We can process a delete patch right away
-    if (zdir_patch_op (self->patch) == patch_delete) {
+    if (zdir_patch_op (patch) == patch_delete) {
         zsys_debug ("~~~ current patch is delete ~~~");
         fmq_msg_set_sequence (self->message, self->sequence++);
         fmq_msg_set_operation (self->message, FMQ_MSG_FILE_DELETE);
         fmq_msg_set_eof (self->message, 0);
+        zchunk_t *chunk = zchunk_new (NULL, 0);
+        fmq_msg_set_chunk (self->message, &chunk);
 
         //  No reliability in this version, assume patch delivered safely
-        zdir_patch_destroy (&self->patch);
+        update_destroy (&self->update);
     }
     else
-    if (zdir_patch_op (self->patch) == patch_create) {
+    if (zdir_patch_op (patch) == patch_create) {
         zsys_debug ("~~~ current patch is create ~~~");
-        //  Create patch refers to file, open that for input if needed
-        if (self->file == NULL) {
-            zsys_debug ("~~~ client's file is NULL ~~~");
-            self->file = zfile_dup (zdir_patch_file (self->patch));
-            if (zfile_input (self->file)) {
-                //  File no longer available, skip it
-                zsys_debug ("~~~ file no longer available ~~~");
-                zdir_patch_destroy (&self->patch);
-                zfile_destroy (&self->file);
-                engine_set_next_event (self, next_patch_event);
-                return;
-            }
-            self->offset = 0;
-        }
-        //  Get next chunk for file
-        zsys_debug ("~~~ read chunk from file ~~~");
-        zchunk_t *chunk = zfile_read (self->file, CHUNK_SIZE, self->offset);
-        assert (chunk);
+        //  Size next chunk for file, within the range the client wants
+        off_t limit = zfile_cursize (self->file);
+        if (self->ranges)
+            limit = s_client_next_range (self, limit);
+        size_t chunk_size = 0;
+        if (self->offset < limit)
+            chunk_size = limit - self->offset;
+        if (chunk_size > s_client_chunk_size (self))
+            chunk_size = s_client_chunk_size (self);
+
+        //  We're done with any chunk we sent last time
+        server_cache_release (self->server, &self->cached);
 
         //  Check if we have the credit to send chunk
-        if (zchunk_size (chunk) <= self->credit) {
+        if (chunk_size <= self->credit) {
             zsys_debug ("~~~ have credit, prepare to send ~~~");
             fmq_msg_set_sequence (self->message, self->sequence++);
             fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
             fmq_msg_set_offset (self->message, self->offset);
             fmq_msg_set_eof (self->message, 0);
-
-            self->offset += zchunk_size (chunk);
-            self->credit -= zchunk_size (chunk);
+            if (self->fresh && self->update->digest) {
+                //  Tell client which file this is, so it can resume it
+                headers = zhash_new ();
+                zhash_autofree (headers);
+                zhash_insert (headers, "digest", self->update->digest);
+                fmq_msg_set_headers (self->message, &headers);
+            }
+            self->fresh = false;
+            if (chunk_size)
+                s_client_read_ahead (self, chunk_size);
 
             //  Zero-sized chunk means end of file
-            if (zchunk_size (chunk) == 0) {
+            if (chunk_size == 0) {
                 zsys_debug ("~~~ chunk is empty ~~~");
+                zchunk_t *chunk = zchunk_new (NULL, 0);
+                fmq_msg_set_chunk (self->message, &chunk);
                 fmq_msg_set_eof (self->message, 1);
                 zfile_destroy (&self->file);
-                zdir_patch_destroy (&self->patch);
+                zchunk_destroy (&self->ranges);
+                update_destroy (&self->update);
+            }
+            else
+            if (self->local) {
+                s_client_set_source (self, chunk_size);
+                zsys_debug ("~~~ client copies chunk from file ~~~");
+            }
+            else
+            if (self->update->links == 1 && self->worker)
+                //  Our worker reads the chunk, off the reactor
+                self->unread = chunk_size;
+            else {
+                //  Share the chunk if other clients are sending this file
+                bool read = false;
+                if (self->update->links > 1)
+                    read = s_client_set_cached_chunk (self, chunk_size);
+                else {
+                    zchunk_t *chunk = s_file_read (self->file, chunk_size,
+                                                   self->offset);
+                    if (chunk) {
+                        fmq_msg_set_chunk (self->message, &chunk);
+                        read = true;
+                    }
+                }
+                if (!read) {
+                    //  File changed under us, so give up on this copy
+                    s_msg_set_failed (self->message, chunk_size);
+                    zfile_destroy (&self->file);
+                    zchunk_destroy (&self->ranges);
+                    update_destroy (&self->update);
+                }
             }
-            fmq_msg_set_chunk (self->message, &chunk);
+            self->offset += chunk_size;
+            self->credit -= chunk_size;
         }
         else {
             zsys_debug ("~~~ no credit ~~~");
-            zchunk_destroy (&chunk);
-            engine_set_next_event (self, no_credit_event);
+            return no_credit_event;
         }
     }
+    return NULL_event;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Pass a copy of the prepared message to the client's worker, which reads
+//  and compresses its chunk as needed and sends it on. All our file
+//  messages to the client go that way, so they arrive in order.
+
+static void
+s_client_hand_off (client_t *self)
+{
+    fmq_msg_t *message = fmq_msg_new ();
+    s_msg_move (message, self->message);
+
+    //  The worker reads the chunk if we didn't
+    const char *filename = "";
+    if (self->unread) {
+        filename = zfile_filename (self->file, NULL);
+        zchunk_t *chunk = NULL;
+        fmq_msg_set_chunk (message, &chunk);
+    }
+    int level = 0;
+    if (self->compress) {
+        char *value = zconfig_resolve (self->server->config,
+            "fmq_server/compress_level", NULL);
+        level = value? atoi (value): COMPRESS_LEVEL;
+    }
+    self->worker->queued++;
+    zsock_send (self->worker->actor, "ssps888i", "SEND", self->id,
+        message, filename,
+        (uint64_t) (self->unread? zfile_modified (self->file): 0),
+        (uint64_t) fmq_msg_offset (self->message),
+        (uint64_t) self->unread, level);
+    self->unread = 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  get_next_patch_for_client
+//
+
+static void
+get_next_patch_for_client (client_t *self)
+{
+    if (!self->worker)
+        self->worker = server_worker (self->server, self);
+    if (self->worker && self->worker->queued >= WORKER_QUEUE) {
+        //  Wait in the ready state until our worker catches up
+        self->worker->stalled = true;
+        engine_set_exception (self, no_credit_event);
+        return;
+    }
+    event_t event = s_client_next_chunk (self);
+    if (event) {
+        engine_set_exception (self, event);
+        return;
+    }
+    self->batched++;
+    if (self->worker) {
+        s_client_hand_off (self);
+        engine_set_exception (self, handed_off_event);
+    }
+    else
+    if (fmq_msg_id (self->message) == FMQ_MSG_CHEEZBURGERS)
+        engine_set_exception (self, send_bundle_event);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  pause_dispatching
+//
+
+static void
+pause_dispatching (client_t *self)
+{
+    zsys_debug ("!!! client sent a batch, moving to ready state !!!");
+    self->batched = 0;
+    if (!self->paused) {
+        if (zlist_size (self->server->paused) == 0)
+            zstr_send (self->server->nudge, "NUDGE");
+        zlist_append (self->server->paused, self);
+        self->paused = true;
+    }
 }
 
 
@@ -687,6 +4171,7 @@ static void
 handle_client_no_credit (client_t *self)
 {
     zsys_debug ("!!! client has no credit, moving to ready state !!!");
+    self->batched = 0;
 }
 
 
@@ -698,4 +4183,44 @@ static void
 handle_client_finished (client_t *self)
 {
     zsys_debug ("!!! client has no patches, moving to ready state !!!");
+    self->batched = 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  summarize_directories
+//
+
+static void
+summarize_directories (client_t *self)
+{
+    //  Tell the client what each directory it asks about holds, so it can
+    //  work out which parts of its path differ from ours. Names are one
+    //  per line, relative to the path.
+    const char *path = fmq_msg_path (self->message);
+    mount_t *mount = s_server_mount (self->server, path);
+    if (mount) {
+        mount_catch_up (mount, self);
+        mount_tree_build (mount);
+    }
+
+    zchunk_t *summary = zchunk_new (NULL, 0);
+    zchunk_t *names = fmq_msg_names (self->message);
+    const char *needle = names? (const char *) zchunk_data (names): NULL;
+    const char *ceiling = needle? needle + zchunk_size (names): NULL;
+    while (needle < ceiling) {
+        const char *end = (const char *) memchr (needle, '\n',
+                                                 ceiling - needle);
+        if (!end)
+            end = ceiling;
+        char *name = (char *) zmalloc (end - needle + 1);
+        memcpy (name, needle, end - needle);
+        char *vpath = s_vpath_join (path, name);
+        mount_tree_summarize (mount,
+            mount? mount_tree_path (mount, vpath): NULL, summary);
+        free (vpath);
+        free (name);
+        needle = end + 1;
+    }
+    fmq_msg_set_summary (self->message, &summary);
 }